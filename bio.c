@@ -116,6 +116,85 @@ bread(uint dev, uint blockno)
 }
 
 
+// Copy n bytes at off in the indicated block into dst,
+// for file data, which the page cache holds (see pcread).
+// If the block is in the buffer cache, it may be newer
+// than the disk (logged but not yet installed), so copy
+// from there. Otherwise read the disk into a private buf,
+// so that reading a big file does not push the metadata
+// blocks out of the buffer cache.
+void
+bfetch(uint dev, uint blockno, char *dst, uint off, uint n)
+{
+	struct buf *b;
+
+	acquire(&bcache.lock);
+	for (b = bcache.head.next; b != &bcache.head; b = b->next)
+	{
+		if (b->dev == dev && b->blockno == blockno)
+		{
+			b->refcnt++;
+			release(&bcache.lock);
+			acquiresleep(&b->lock);
+			if (!(b->flags & B_VALID))
+				iderw(b);
+			memmove(dst, b->data + off, n);
+			brelse(b);
+			return;
+		}
+	}
+	release(&bcache.lock);
+
+	if ((b = kmalloc(sizeof(*b))) == 0)
+	{
+		// No memory for a private buf; go through the cache.
+		b = bread(dev, blockno);
+		memmove(dst, b->data + off, n);
+		brelse(b);
+		return;
+	}
+	initsleeplock(&b->lock, "fetch");
+	acquiresleep(&b->lock);
+	b->dev = dev;
+	b->blockno = blockno;
+	b->flags = 0;
+	iderw(b);
+	memmove(dst, b->data + off, n);
+	releasesleep(&b->lock);
+	kmfree(b);
+}
+
+
+// Read or write n consecutive blocks from blockno
+// straight to or from the disk, through b, a locked buf
+// of the caller's that is not in the cache. For the swap
+// area, which no one else reads or writes, and which must
+// work when there is no memory left to allocate a buf.
+void
+bdirect(struct buf *b, uint dev, uint blockno, char *data, uint n, int write)
+{
+	uint i;
+
+	if (!holdingsleep(&b->lock))
+		panic("bdirect");
+	b->dev = dev;
+	for (i = 0; i < n; i++, data += BSIZE)
+	{
+		b->blockno = blockno + i;
+		if (write)
+		{
+			memmove(b->data, data, BSIZE);
+			b->flags = B_DIRTY;
+		}
+		else
+			b->flags = 0;
+		iderw(b);
+		if (!write)
+			memmove(data, b->data, BSIZE);
+	}
+}
+
+
 // Write b's contents to disk.
 // Must be B_BUSY.
 void
@@ -270,6 +270,10 @@ consoleintr(int (*getc)(void))
 	{
 		// now call procdump() without cons.lock held
 		procdump();
+		kmemdump();
+		kmcachedump();
+		pcachedump();
+		swapdump();
 	}
 }
 
@@ -1,18 +1,26 @@
+struct aspace;
 struct buf;
 struct context;
+struct cpage;
+struct fdtable;
 struct file;
 struct inode;
+struct kmcache;
 struct pipe;
 struct proc;
 struct rtcdate;
 struct spinlock;
+struct shmseg;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void			binit(void);
 struct buf*		bread(uint, uint);
+void			bfetch(uint, uint, char*, uint, uint);
+void			bdirect(struct buf*, uint, uint, char*, uint, int);
 void			brelse(struct buf*);
 void			bwrite(struct buf*);
 
@@ -22,8 +30,14 @@ void			cprintf(char*, ...);
 void			consoleintr(int(*)(void));
 void			panic(char*) __attribute__((noreturn));
 
+// e820.c
+void			e820init(void);
+int				memrange(int, uint*, uint*);
+extern uint		phystop;
+
 // exec.c
 int				exec(char*, char**);
+int				execimage(struct proc*, char*, char**);
 
 // file.c
 struct file*	filealloc(void);
@@ -49,10 +63,16 @@ void			iupdate(struct inode*);
 int				namecmp(const char*, const char*);
 struct inode*	namei(char*);
 struct inode*	nameiparent(char*, char*);
+void			readblocks(struct inode*, char*, uint, uint);
 int				readi(struct inode*, char*, uint, uint);
 void			stati(struct inode*, struct stat*);
 int				writei(struct inode*, char*, uint, uint);
 
+// futex.c
+void			futexinit(void);
+int				futexwait(uint, uint);
+int				futexwake(uint, int);
+
 // ide.c
 void			ideinit(void);
 void			ideintr(void);
@@ -65,9 +85,18 @@ void			ioapicinit(void);
 
 // kalloc.c
 char*			kalloc(void);
+char*			kalloc_pages(int);
+char*			kalloc_zeroed(void);
 void			kfree(char*);
+void			kfree_pages(char*, int);
+uint			kfreepages(void);
 void			kinit1(void*, void*);
 void			kinit2(void*, void*);
+void			kmemdump(void);
+void			kref(char*);
+int				krefcount(char*);
+void			ksplit(char*, int);
+void			kzeroidle(void);
 
 // kbd.c
 void			kbdintr(void);
@@ -78,6 +107,7 @@ int				cpunum(void);
 extern volatile uint*	lapic;
 void			lapiceoi(void);
 void			lapicinit(void);
+void			lapicipi(uchar, int);
 void			lapicstartap(uchar, uint);
 void			microdelay(int);
 
@@ -91,34 +121,79 @@ void			end_op();
 extern int		ismp;
 void			mpinit(void);
 
+// pcache.c
+void			pcacheinit(void);
+struct cpage*	pcread(struct inode*, uint);
+void			pcrelse(struct cpage*);
+void			pcwrite(struct inode*, char*, uint, uint);
+void			pcinval(struct inode*, uint, uint);
+void			pcachedump(void);
+
 // picirq.c
 void			picenable(int);
 void			picinit(void);
 
 // pipe.c
+void			pipeinit(void);
 int				pipealloc(struct file**, struct file**);
 void			pipeclose(struct pipe*, int);
 int				piperead(struct pipe*, char*, int);
 int				pipewrite(struct pipe*, char*, int);
 
 // proc.c
+struct aspace*	asalloc(void);
+void			aslock(struct aspace*);
+void			asput(struct aspace*);
+void			asunlock(struct aspace*);
+int				clone(uint, uint, uint, uint);
 void			exit(void);
+struct fdtable*	fdtalloc(void);
+void			fdtput(struct fdtable*);
 int				fork(void);
 int				growproc(int);
+int				join(uint*);
 int				kill(int);
 void			pinit(void);
 void			procdump(void);
 void			scheduler(void) __attribute__((noreturn));
 void			sched(void);
+int				schedtick(void);
+int				setpriority(int, int);
+int				setrealtime(int, int, int);
+int				settickets(int);
+int				setaffinity(int, uint);
+int				getaffinity(int);
 void			sleep(void*, struct spinlock*);
+int				spawn(char*, char**, struct file**);
+int				swapout(void);
+int				ubufbusy(uint, uint);
 void			userinit(void);
 int				wait(void);
 void			wakeup(void*);
 void			yield(void);
 
+// swap.c
+void			swapinit(int);
+uint			swapfreepages(void);
+int				swapalloc(void);
+void			swapcancel(uint);
+void			swapdup(uint);
+void			swapfree(uint);
+void			swapwrite(uint, char*);
+void			swapread(uint, char*);
+void			swapdump(void);
+
 // swtch.S
 void			swtch(struct context**, struct context*);
 
+// slab.c
+void			slabinit(void);
+struct kmcache*	kmcache_create(char*, uint);
+void*			kmcache_alloc(struct kmcache*);
+void*			kmalloc(uint);
+void			kmfree(void*);
+void			kmcachedump(void);
+
 // spinlock.c
 void			acquire(struct spinlock*);
 void			getcallerpcs(void*, uint*);
@@ -128,6 +203,16 @@ void			release(struct spinlock*);
 void			pushcli(void);
 void			popcli(void);
 
+// shm.c
+void			shminit(void);
+int				shmget(int, uint);
+int				shmat(int);
+int				shmdt(uint);
+int				shmok(uint, uint);
+int				shmrm(int);
+int				shmfork(struct proc*);
+void			shmrelease(struct aspace*);
+
 // sleeplock.c
 void			acquiresleep(struct sleeplock*);
 void			releasesleep(struct sleeplock*);
@@ -146,6 +231,7 @@ char*			strncpy(char*, const char*, int);
 // syscall.c
 int				argint(int, int*);
 int				argptr(int, char**, int);
+int				argwptr(int, char**, int);
 int				argstr(int, char**);
 int				fetchint(uint, int*);
 int				fetchstr(uint, char**);
@@ -172,11 +258,23 @@ pde_t*			setupkvm(void);
 char*			uva2ka(pde_t*, char*);
 int				allocuvm(pde_t*, uint, uint);
 int				deallocuvm(pde_t*, uint, uint);
+int				allocsuper(pde_t*, uint, uint);
+int				nsuper(pde_t*, uint);
 void			freevm(pde_t*);
 void			inituvm(pde_t*, char*, uint);
-int				loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*			copyuvm(pde_t*, uint);
+pde_t*			copyuvm(pde_t*, uint, int);
+int				copyvma(pde_t*, pde_t*, struct vma*, int);
+int				mapshared(pde_t*, uint, char**, int);
+int				cowfault(pde_t*, uint);
+int				pagefault(uint);
+int				prefault(uint, uint, int);
+void			freevmas(pde_t*, struct vma*);
+uint*			clockscan(pde_t*, uint*, uint);
+int				vmamap(struct inode*, uint, int, uint);
+int				vmaunmap(uint, uint);
+int				vmaok(uint, uint, int);
 void			switchuvm(struct proc*);
+void			tlbshootdown(struct aspace*);
 void			switchkvm(void);
 int				copyout(pde_t*, uint, void*, uint);
 void			clearpteu(pde_t *pgdir, char *uva);
@@ -0,0 +1,133 @@
+// Physical memory detection.
+// bootasm.S asks the BIOS for its memory map (INT 0x15,
+// %eax=0xE820) and leaves it at E820MAP. Turn that into a
+// sorted list of non-overlapping usable ranges, and find
+// phystop, the top of usable physical memory.
+// http://www.uruk.org/orig-grub/mem64mb.html
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+
+#define NMEMRANGE	16		// max usable ranges kept
+
+#define E820_RAM	1		// usable memory; all other types are reserved
+
+// BIOS memory map entry
+struct e820entry {
+	uint addrlo;			// base address, low and high words
+	uint addrhi;
+	uint lenlo;				// length, low and high words
+	uint lenhi;
+	uint type;				// E820_RAM or reserved
+};
+
+// The map as left by bootasm.S
+struct e820map {
+	uint nentry;
+	struct e820entry entry[NE820];
+};
+
+// Usable physical memory [start, end), page aligned.
+struct memrange {
+	uint start;
+	uint end;
+};
+
+static struct memrange mem[NMEMRANGE];
+static int nmem;
+uint phystop;
+
+// Add the usable range [start, end) to mem[], keeping
+// mem[] sorted by start and merging any overlap, so
+// that no page is ever handed to kalloc twice.
+static void
+addrange(uint start, uint end)
+{
+	int i, j;
+
+	start = PGROUNDUP(start);
+	end = PGROUNDDOWN(end);
+	if (start >= end)
+		return;
+
+	// Merge with every range that overlaps or touches it
+	for (i = 0; i < nmem; )
+	{
+		if (mem[i].end < start || mem[i].start > end)
+		{
+			i++;
+			continue;
+		}
+		if (mem[i].start < start)
+			start = mem[i].start;
+		if (mem[i].end > end)
+			end = mem[i].end;
+		for (j = i; j < nmem-1; j++)
+			mem[j] = mem[j+1];
+		nmem--;
+	}
+
+	if (nmem == NMEMRANGE)
+	{
+		cprintf("e820: too many ranges, ignoring 0x%x-0x%x\n", start, end);
+		return;
+	}
+	for (i = nmem; i > 0 && mem[i-1].start > start; i--)
+		mem[i] = mem[i-1];
+	mem[i].start = start;
+	mem[i].end = end;
+	nmem++;
+}
+
+
+// Read the BIOS memory map. Must run before kinit1().
+// If there is no map (e.g. the kernel was started by
+// a multiboot loader rather than bootasm.S), assume
+// memory runs contiguously up to PHYSTOP.
+void
+e820init(void)
+{
+	struct e820map *map;
+	struct e820entry *e;
+	uint end;
+
+	map = P2V(E820MAP);
+	if (map->nentry <= NE820)
+	{
+		for (e = map->entry; e < &map->entry[map->nentry]; e++)
+		{
+			// The kernel can only map physical memory
+			// below PHYSLIMIT; drop anything above.
+			if (e->type != E820_RAM || e->addrhi != 0 || e->addrlo >= PHYSLIMIT)
+				continue;
+			end = e->addrlo + e->lenlo;
+			if (e->lenhi != 0 || end < e->addrlo || end > PHYSLIMIT)
+				end = PHYSLIMIT;
+			addrange(e->addrlo, end);
+		}
+	}
+
+	if (nmem == 0 || mem[nmem-1].end <= EXTMEM)
+	{
+		cprintf("e820: no usable memory map, assuming 0x%x bytes\n", PHYSTOP);
+		nmem = 0;
+		addrange(0, PHYSTOP);
+	}
+	phystop = mem[nmem-1].end;
+}
+
+
+// Return the i'th usable range of physical memory
+// in *start and *end. Returns 0 if there is none.
+int
+memrange(int i, uint *start, uint *end)
+{
+	if (i < 0 || i >= nmem)
+		return 0;
+	*start = mem[i].start;
+	*end = mem[i].end;
+	return 1;
+}
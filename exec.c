@@ -1,4 +1,10 @@
 // exec() is the system call that creates the user part of the address space.
+//
+// Program segments are not read in here. Each one is recorded
+// as a file-backed region (struct vma) of the new image, and
+// its pages are read from the executable the first time they
+// are touched (see pagefault in vm.c), so exec() takes the
+// same time for any size of binary.
 
 #include "types.h"
 #include "param.h"
@@ -9,16 +15,22 @@
 #include "x86.h"
 #include "elf.h"
 
+// Replace the user image of p, which is the current process
+// or a new one that spawn() is setting up, with the program
+// at path. p's old image, if it has one, is freed only once
+// the new one is complete. Returns 0, or -1 with p unchanged.
 int
-exec(char *path, char **argv)
+execimage(struct proc *p, char *path, char **argv)
 {
 	char *s, *last;
-	int i, off;
+	int i, off, nvma;
 	uint argc, sz,sp, ustack[3+MAXARG+1];
 	struct elfhdr elf;
 	struct inode *ip;
 	struct proghdr ph;
-	pde_t *pgdir, *oldpgdir;
+	pde_t *pgdir;
+	struct vma vma[NVMA];
+	struct aspace *as, *old;
 
 	begin_op();
 	// Initalize the user part of the address space
@@ -31,6 +43,8 @@ exec(char *path, char **argv)
 	}
 	ilock(ip);
 	pgdir = 0;
+	memset(vma, 0, sizeof(vma));
+	nvma = 0;
 
 	// Check ELF header
 	if (readi(ip, (char*)&elf, 0, sizeof(elf)) < sizeof(elf))
@@ -53,14 +67,22 @@ exec(char *path, char **argv)
 			goto bad;
 		if (ph.vaddr + ph.memsz < ph.vaddr)
 			goto bad;
-		// Allocate memory for each ELF segment
-		if ((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+		if (ph.vaddr + ph.memsz >= MMAPBASE)
 			goto bad;
 		if (ph.vaddr % PGSIZE != 0)
 			goto bad;
-		// Load each segment into memory
-		if (loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+		if (ph.vaddr < sz || nvma >= NVMA)
 			goto bad;
+		// Record the segment; its pages are read
+		// from ip when first touched.
+		vma[nvma].start = ph.vaddr;
+		vma[nvma].end = ph.vaddr + ph.memsz;
+		vma[nvma].ip = idup(ip);
+		vma[nvma].off = ph.off;
+		vma[nvma].filesz = ph.filesz;
+		vma[nvma].flags = VMA_WRITE;
+		nvma++;
+		sz = ph.vaddr + ph.memsz;
 	}
 	iunlockput(ip);
 	end_op();
@@ -113,18 +135,25 @@ exec(char *path, char **argv)
 		if(*s == '/')
 			last = s+1;
 
-	safestrcpy(proc->name, last, sizeof(proc->name));
+	if ((as = asalloc()) == 0)
+		goto bad;
+	safestrcpy(p->name, last, sizeof(p->name));
 
 	// Commit to the user image
-	oldpgdir = proc->pgdir;
-	proc->pgdir = pgdir;
-	proc->sz = sz;
-	proc->tf->eip = elf.entry;		// main
-	proc->tf->esp = sp;
-	switchuvm(proc);
+	as->pgdir = pgdir;
+	as->sz = sz;
+	memmove(as->vma, vma, sizeof(vma));
+	old = p->as;
+	p->as = as;
+	p->tf->eip = elf.entry;		// main
+	p->tf->esp = sp;
+	if (p == proc)
+		switchuvm(p);
 	// exec() must wait until it is sure that the system
 	// call will succeed before it can free the old image.
-	freevm(oldpgdir);
+	// Other threads that share it keep running there.
+	if (old)
+		asput(old);
 
 	return 0;
 
@@ -132,13 +161,21 @@ exec(char *path, char **argv)
 // we jump here, free the new image, and return -1.
 // The only error cases happen during the creation of the image.
 bad:
-	if (pgdir)
-		freevm(pgdir);
 	if (ip)
 	{
 		iunlockput(ip);
 		end_op();
 	}
+	freevmas(pgdir, vma);
+	if (pgdir)
+		freevm(pgdir);
 	cprintf("exec() failed");
 	return -1;
 }
+
+
+int
+exec(char *path, char **argv)
+{
+	return execimage(proc, path, argv);
+}
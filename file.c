@@ -11,15 +11,21 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+
+// File structures are allocated from a slab cache
+// as they are opened and freed on last close.
+// At most NFILE may be open at once.
 struct {
 	struct spinlock lock;
-	struct file file[NFILE];
+	struct kmcache *cache;
+	int nfile;			// files currently allocated
 } ftable;
 
 void
 fileinit(void)
 {
 	initlock(&ftable.lock, "ftable");
+	ftable.cache = kmcache_create("file", sizeof(struct file));
 }
 
 
@@ -30,17 +36,24 @@ filealloc(void)
 	struct file *f;
 
 	acquire(&ftable.lock);
-	for (f = ftable.file; f < ftable.file + NFILE; f++)
+	if (ftable.nfile >= NFILE)
 	{
-		if (f->ref == 0)
-		{
-			f->ref = 1;
-			release(&ftable.lock);
-			return f;
-		}
+		release(&ftable.lock);
+		return 0;
 	}
+	ftable.nfile++;
 	release(&ftable.lock);
-	return 0;
+
+	if ((f = kmcache_alloc(ftable.cache)) == 0)
+	{
+		acquire(&ftable.lock);
+		ftable.nfile--;
+		release(&ftable.lock);
+		return 0;
+	}
+	memset(f, 0, sizeof(*f));
+	f->ref = 1;
+	return f;
 }
 
 
@@ -74,9 +87,9 @@ fileclose(struct file *f)
 	}
 
 	ff = *f;
-	f->ref = 0;
-	f->type = FD_NONE;
+	ftable.nfile--;
 	release(&ftable.lock);
+	kmfree(f);
 
 	if (ff.type == FD_PIPE)
 		pipeclose(ff.pipe, ff.writable);
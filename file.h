@@ -9,11 +9,23 @@ struct file {
 };
 
 
+// Open files and current directory. The threads of a
+// process made by clone() all use the same table, like
+// struct aspace, which lives until the last of them exits.
+struct fdtable {
+	int ref;						// Threads using it; 0 if free (ptable.lock)
+	struct spinlock lock;			// Protects ofile[] and cwd
+	struct file *ofile[NOFILE];		// Open files
+	struct inode *cwd;				// Current working directory
+};
+
+
 // in-memory copy of an inode
 struct inode {
 	uint dev;			// Device number
 	uint inum;			// Inode number
 	int ref;			// Reference count
+	struct inode *next;	// Next in icache list
 	struct sleeplock lock;	// Replaces I_BUSY
 	int flags;			// I_VALID
 
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "pcache.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
@@ -174,20 +175,22 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 
+// In-memory inodes are allocated from a slab cache
+// by iget() and freed by iput() when the last
+// reference goes away. At most NINODE may be
+// active at once.
 struct {
 	struct spinlock lock;
-	struct inode inode[NINODE];
+	struct kmcache *cache;
+	struct inode *list;		// active inodes, through next
+	int ninode;				// length of list
 } icache;
 
 void
 iinit(int dev)
 {
-	int i = 0;
 	initlock(&icache.lock, "icache");
-	for (i = 0; i < NINODE; i++)
-	{
-		initsleeplock(&icache.inode[i].lock, "inode");
-	}
+	icache.cache = kmcache_create("inode", sizeof(struct inode));
 
 	readsb(dev, &sb);
 	cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -199,12 +202,14 @@ static struct inode* iget(uint dev, uint inum);
 
 // Allocate a new inode with the given type on device dev.
 // A free inode has a type of zero.
+// Returns 0 if there is no memory for its in-memory copy.
 struct inode*
 ialloc(uint dev, short type)
 {
 	int inum;
 	struct buf *bp;
 	struct dinode *dip;
+	struct inode *ip;
 
 	for (inum = 1; inum < sb.ninodes; inum++)
 	{
@@ -213,11 +218,18 @@ ialloc(uint dev, short type)
 		// If a free inode...
 		if (dip->type == 0)
 		{
+			// Get the in-memory copy first, so that
+			// failing leaves the disk alone.
+			if ((ip = iget(dev, inum)) == 0)
+			{
+				brelse(bp);
+				return 0;
+			}
 			memset(dip, 0, sizeof(*dip));
 			dip->type = type;
 			log_write(bp);			// mark it allocated on the disk
 			brelse(bp);
-			return iget(dev, inum);
+			return ip;
 		}
 		brelse(bp);
 	}
@@ -248,36 +260,41 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if it is not cached and there is no room
+// for another in-memory inode.
 static struct inode*
 iget(uint dev, uint inum)
 {
-	struct inode *ip, *empty;
+	struct inode *ip;
 
 	acquire(&icache.lock);
 
 	// Is the inode already cached?
-	empty = 0;
-	for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++)
+	for (ip = icache.list; ip; ip = ip->next)
 	{
-		if (ip->ref > 0 && ip->dev == dev && ip->inum == inum)
+		if (ip->dev == dev && ip->inum == inum)
 		{
 			ip->ref++;
 			release(&icache.lock);
 			return ip;
 		}
-		if (empty == 0 && ip->ref == 0)		// Remember empty slot
-			empty = ip;
 	}
 
-	// Recycle an inode cache entry
-	if (empty == 0)
-		panic("iget: no inodes");
+	// Allocate a new in-memory inode
+	if (icache.ninode >= NINODE || (ip = kmcache_alloc(icache.cache)) == 0)
+	{
+		release(&icache.lock);
+		return 0;
+	}
 
-	ip = empty;
+	initsleeplock(&ip->lock, "inode");
 	ip->dev = dev;
 	ip->inum = inum;
 	ip->ref = 1;
 	ip->flags = 0;
+	ip->next = icache.list;
+	icache.list = ip;
+	icache.ninode++;
 	release(&icache.lock);
 
 	return ip;
@@ -339,8 +356,8 @@ iunlock(struct inode *ip)
 
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache
-// entry can be recycled.
+// If that was the last reference, the in-memory
+// inode is freed.
 // If that was the last reference and the inode has
 // no links to it, free the inode (and its content)
 // on disk.
@@ -349,6 +366,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+	struct inode **pp;
+
 	acquire(&icache.lock);
 	if (ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0)
 	{
@@ -361,7 +380,16 @@ iput(struct inode *ip)
 		acquire(&icache.lock);
 		ip->flags = 0;
 	}
-	ip->ref--;
+	if (--ip->ref == 0)
+	{
+		for (pp = &icache.list; *pp != ip; pp = &(*pp)->next)
+			;
+		*pp = ip->next;
+		icache.ninode--;
+		release(&icache.lock);
+		kmfree(ip);
+		return;
+	}
 	release(&icache.lock);
 }
 
@@ -456,6 +484,7 @@ itrunc(struct inode *ip)
 		ip->addrs[NDIRECT] = 0;
 	}
 
+	pcinval(ip, 0, ip->size);
 	ip->size = 0;
 	iupdate(ip);
 }
@@ -473,12 +502,32 @@ stati(struct inode *ip, struct stat *st)
 }
 
 
+// Read n bytes of ip's data blocks at off into dst, for
+// the page cache. Does not check against ip->size.
+// Caller must hold ip's lock.
+void
+readblocks(struct inode *ip, char *dst, uint off, uint n)
+{
+	uint tot, m;
+
+	for (tot = 0; tot < n; tot+=m, off+=m, dst+=m)
+	{
+		m = min(n - tot, BSIZE - off%BSIZE);
+		bfetch(ip->dev, bmap(ip, off/BSIZE), dst, off%BSIZE, m);
+	}
+}
+
+
 // Read data from inode.
+// File and directory contents come from the page cache,
+// a page at a time; the buffer cache holds only the
+// blocks they are read from until the log is done
+// with them (see bfetch).
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
 	uint tot, m;
-	struct buf *bp;
+	struct cpage *cp;
 
 	if (ip->type == T_DEV)
 	{
@@ -496,10 +545,15 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 
 	for (tot = 0; tot < n; tot+=m, off+=m, dst+=m)
 	{
-		bp = bread(ip->dev, bmap(ip, off/BSIZE));
-		m = min(n - tot, BSIZE - off%BSIZE);
-		memmove(dst, bp->data + off%BSIZE, m);
-		brelse(bp);
+		m = min(n - tot, PGSIZE - off%PGSIZE);
+		if ((cp = pcread(ip, PGROUNDDOWN(off))) == 0)
+		{
+			// Cache full of mapped pages: read around it.
+			readblocks(ip, dst, off, m);
+			continue;
+		}
+		memmove(dst, cp->data + off%PGSIZE, m);
+		pcrelse(cp);
 	}
 	return n;
 }
@@ -534,6 +588,9 @@ writei(struct inode *ip, char *src, uint off, uint n)
 		log_write(bp);
 		brelse(bp);
 	}
+	// Keep cached and mapped pages of the file current.
+	if (n > 0)
+		pcwrite(ip, src - n, off - n, n);
 
 	if (n > 0 && off > ip->size)
 	{
@@ -557,6 +614,7 @@ namecmp(const char *s, const char *t)
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Returns 0 if there is none, or no memory for its inode.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -592,26 +650,28 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-	int off;
+	int off, empty;
 	struct dirent de;
-	struct inode *ip;
-
-	// Check that name is not present
-	if ((ip = dirlookup(dp, name, 0)) != 0)
-	{
-		iput(ip);
-		return -1;
-	}
 
-	// Look for an empty dirent
+	// Check that name is not present, and look for an
+	// empty dirent. Compares names rather than using
+	// dirlookup(), which can fail for lack of memory.
+	empty = -1;
 	for (off = 0; off < dp->size; off += sizeof(de))
 	{
 		if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
 			panic("dirlink read");
 
 		if (de.inum == 0)
-			break;
+		{
+			if (empty < 0)
+				empty = off;
+		}
+		else if (namecmp(name, de.name) == 0)
+			return -1;
 	}
+	if (empty >= 0)
+		off = empty;
 
 	strncpy(de.name, name, DIRSIZ);
 	de.inum = inum;
@@ -687,11 +747,18 @@ _namei(struct inode *root, char *path, int parent, char *name, int depth)
 		return 0;
 
 	if (*path == '/')
-		ip = iget(ROOTDEV, ROOTINO);
+	{
+		if ((ip = iget(ROOTDEV, ROOTINO)) == 0)
+			return 0;
+	}
 	else if (root)
 		ip = idup(root);
 	else
-		ip = idup(proc->cwd);
+	{
+		acquire(&proc->fdt->lock);
+		ip = idup(proc->fdt->cwd);
+		release(&proc->fdt->lock);
+	}
 
 	while ((path = skipelem(path, name)) != 0)
 	{
@@ -728,7 +795,11 @@ _namei(struct inode *root, char *path, int parent, char *name, int depth)
 			}
 			buf[next->size] = 0;
 			iunlockput(next);
-			next = _namei(ip, buf, 0, tname, depth + 1);
+			if ((next = _namei(ip, buf, 0, tname, depth + 1)) == 0)
+			{
+				iput(ip);
+				return 0;
+			}
 		}
 		else
 			iunlock(next);
@@ -5,7 +5,10 @@
 #define BSIZE	512	// block size
 
 // Disk layout:
-// [boot block |super block |log |inode blocks |free bit map |data blocks]
+// [boot block |super block |log |inode blocks |free bit map |data blocks |swap]
+//
+// The swap area lies past the end of the file system proper
+// (sb.size) and holds user pages evicted by swap.c.
 //
 // mkfs computes the super block and builds an initial file system.
 // The super block describes the disk layout
@@ -18,6 +21,8 @@ struct superblock {
 	uint logstart;		// Block number of first log block
 	uint inodestart;	// Block number of first inode block
 	uint bmapstart;		// Block number of first free map block
+	uint swapstart;		// Block number of first swap block
+	uint nswap;			// Number of swap blocks
 };
 
 #define NDIRECT		12
@@ -0,0 +1,147 @@
+// Futexes: sleeping on a word of user memory.
+//
+// A user-space lock or condition variable does its work
+// with atomic instructions on a word of its own memory and
+// enters the kernel only to block or to wake up blockers.
+//
+// Interface (system calls in sysproc.c):
+// * futexwait(addr, val) sleeps until a futexwake() on addr,
+//		but only if the word at addr still holds val, so that
+//		a wakeup between the user's test and the call is not
+//		lost. Returns 0 once woken, or -1 at once.
+// * futexwake(addr, n) wakes up to n threads sleeping on
+//		addr, oldest first, and returns how many it woke.
+//
+// A futex is named by the address space and the virtual
+// address of its word, so it works between the threads of
+// a process (see clone), not between processes sharing
+// memory through shm.
+//
+// Each sleeper queues a struct futexq on its own kernel
+// stack, in a hash bucket chosen by its key, and sleeps on
+// it. futex.lock is held from the test of the user's word
+// until the sleep, and by every wakeup.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define NFUTEXHASH	31		// hash buckets, prime
+#define FUTEXHASH(as, va)	((((uint)(as)) / sizeof(struct aspace) + (va)/sizeof(uint)) % NFUTEXHASH)
+
+// A sleeping thread
+struct futexq {
+	struct aspace *as;		// key: address space,
+	uint va;				//		and address of the word
+	int woken;
+	struct futexq *next;	// hash chain, oldest first
+};
+
+struct {
+	struct spinlock lock;
+	struct futexq *hash[NFUTEXHASH];
+} futex;
+
+
+void
+futexinit(void)
+{
+	initlock(&futex.lock, "futex");
+}
+
+
+// Take q off its chain if it is still there.
+// Caller must hold futex.lock.
+static void
+unqueue(struct futexq *q)
+{
+	struct futexq **pp;
+
+	for (pp = &futex.hash[FUTEXHASH(q->as, q->va)]; *pp; pp = &(*pp)->next)
+	{
+		if (*pp == q)
+		{
+			*pp = q->next;
+			break;
+		}
+	}
+}
+
+
+// Sleep on the word at va, which argptr() has checked
+// and faulted in, if it holds val.
+int
+futexwait(uint va, uint val)
+{
+	struct futexq q, **pp;
+	struct aspace *as;
+	uint *w;
+
+	if (va % sizeof(uint))
+		return -1;
+
+	// Hold the mappings still while reading the word
+	// through the kernel's view of its page.
+	as = proc->as;
+	aslock(as);
+	acquire(&futex.lock);
+	w = (uint*)uva2ka(as->pgdir, (char*)PGROUNDDOWN(va));
+	if (w == 0 || w[(va % PGSIZE) / sizeof(uint)] != val)
+	{
+		asunlock(as);
+		release(&futex.lock);
+		return -1;
+	}
+	asunlock(as);
+
+	q.as = as;
+	q.va = va;
+	q.woken = 0;
+	q.next = 0;
+	for (pp = &futex.hash[FUTEXHASH(as, va)]; *pp; pp = &(*pp)->next)
+		;
+	*pp = &q;
+
+	while (!q.woken)
+	{
+		if (proc->killed)
+		{
+			unqueue(&q);
+			release(&futex.lock);
+			return -1;
+		}
+		sleep(&q, &futex.lock);
+	}
+	release(&futex.lock);
+	return 0;
+}
+
+
+// Wake up to n threads sleeping on the word at va.
+int
+futexwake(uint va, int n)
+{
+	struct futexq *q, **pp;
+	int woken;
+
+	woken = 0;
+	acquire(&futex.lock);
+	pp = &futex.hash[FUTEXHASH(proc->as, va)];
+	while ((q = *pp) != 0 && woken < n)
+	{
+		if (q->as != proc->as || q->va != va)
+		{
+			pp = &q->next;
+			continue;
+		}
+		*pp = q->next;
+		q->woken = 1;
+		wakeup(q);
+		woken++;
+	}
+	release(&futex.lock);
+	return woken;
+}
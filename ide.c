@@ -116,7 +116,7 @@ idestart(struct buf *b)
 {
 	if (b == 0)
 		panic("idestart");
-	if (b->blockno >= FSSIZE)
+	if (b->blockno >= FSSIZE + SWAPBLOCKS)
 		panic("incorrect blockno");
 
 	int sector_per_block = BSIZE/SECTOR_SIZE;
@@ -1,40 +1,140 @@
 // Physical memory allocator
 // Intended to allocate memory for user processes,
 // kernel stacks, page table pages, and pipe buffers.
-// Allocates 4096-byte pages.
+// Allocates 4096-byte pages, or physically contiguous
+// blocks of 2^order pages with kalloc_pages().
+//
+// Free memory is kept by a binary buddy allocator
+// protected by kmem.lock: one free list per order, where
+// a block of order k is 2^k pages aligned on a 2^k page
+// physical boundary. Freed blocks are coalesced with their
+// buddy (the block whose address differs only in bit k)
+// whenever both halves are free.
+//
+// Single pages are fronted by a small per-CPU cache of
+// pages (kcache) so that the common kalloc()/kfree() path
+// only touches memory private to the calling CPU. Caches
+// are refilled from, and drained back to, the buddy
+// allocator KCACHE_BATCH pages at a time.
+//
+// A pool of up to ZPOOL_SIZE already-zeroed pages (kzero)
+// is filled by kzeroidle() when a CPU has nothing else to
+// run, so that kalloc_zeroed() can usually hand out a page
+// without clearing it on the caller's critical path.
+//
+// Every allocated page has a reference count, so that a
+// page can be mapped by more than one address space (e.g.
+// shared copy-on-write after fork). kalloc() returns a page
+// with one reference, kref() adds one, and kfree() drops
+// one, only freeing the page when the last one goes.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 
+#define KCACHE_SIZE		32		// max pages held by one per-CPU cache
+#define KCACHE_BATCH	16		// pages moved to/from kmem per refill/drain
+#define ZPOOL_SIZE		64		// pre-zeroed pages kept by kzeroidle()
+#define NREFLOCK		16		// locks guarding page reference counts
+
+#define PFN(v)			(V2P(v) >> PGSHIFT)		// kernel va to page frame
+#define PFN2V(pfn)		((char*)P2V((pfn) << PGSHIFT))
+
 void freerange(void *vstart, void *vend);
 extern char end[];		// first addr after kernel loaded from ELF file
+static char *kstart;	// first allocatable addr, after pages[]
 
+// A free page, or the first page of a free block.
+// prev is only used on the buddy free lists.
 struct run {
 	struct run *next;
+	struct run *prev;
 };
 
+// Per-page metadata, indexed by page frame number.
+// The array is sized for phystop at boot and placed
+// right after the kernel (see kinit1).
+struct page {
+	uchar free;			// first page of a free buddy block
+	uchar order;		// order of that block
+	ushort ref;			// references to an allocated page
+};
+
+static struct page *pages;
+static uint npages;
+
+// Reference counts that may be shared between address
+// spaces are changed under one of these locks, picked
+// by page frame number to spread out contention.
+static struct spinlock reflock[NREFLOCK];
+
 struct {
 	struct spinlock lock;
 	int use_lock;
-	struct run *freelist;
+	struct run *freelist[MAXORDER+1];	// free blocks of each order
+	uint nblocks[MAXORDER+1];			// length of each freelist
+	uint nfree;			// free pages in all blocks
+	uint splits;		// blocks split to satisfy a smaller request
+	uint merges;		// buddies coalesced on free
 } kmem;
 
+// Per-CPU page cache. Only touched by its own CPU
+// with interrupts disabled, so it needs no lock.
+struct kcache {
+	struct run *freelist;
+	int nfree;			// pages on freelist
+	uint hits;			// kalloc()s served from the cache
+	uint misses;		// kalloc()s that had to refill from kmem
+	uint refills;		// batches taken from kmem
+	uint drains;		// batches given back to kmem
+};
+
+static struct kcache kcaches[NCPU];
+
+// Pool of zero-filled pages. Each page is all zero
+// except for the list link in its first word.
+struct {
+	struct spinlock lock;
+	struct run *freelist;
+	int nfree;			// pages on freelist
+	uint hits;			// kalloc_zeroed()s served from the pool
+	uint misses;		// kalloc_zeroed()s that had to memset
+} kzero;
+
 // Initialization happens in 2 phases:
 //	1. main() calls kinit1() while still using entrypgdir to place
 //		just the pages mapped by entrypgdir on free list.
 //	2. main() calls kinit2() with the rest of the physical pages,
 //		after installing a full page table that maps them on all cores.
+// The per-CPU caches are only used once kinit2() has enabled
+// locking; before that, every CPU goes straight to kmem.
+// e820init() must have found phystop before kinit1().
 void
 kinit1(void *vstart, void *vend)
 {
+	int i;
+
 	initlock(&kmem.lock, "kmem");
+	initlock(&kzero.lock, "kzero");
+	for (i = 0; i < NREFLOCK; i++)
+		initlock(&reflock[i], "kref");
 	kmem.use_lock = 0;
+
+	// The page metadata array takes the first pages
+	// after the kernel, sized for all of physical memory.
+	npages = phystop / PGSIZE;
+	pages = (struct page*)vstart;
+	kstart = (char*)PGROUNDUP((uint)(pages + npages));
+	if (kstart > (char*)vend)
+		panic("kinit1: page array too big");
+	memset(pages, 0, kstart - (char*)pages);
+
 	// Add memory to the free list
-	freerange(vstart, vend);
+	freerange(kstart, vend);
 }
 
 void
@@ -46,19 +146,220 @@ kinit2(void *vstart, void *vend)
 }
 
 
+// Free the pages in [vstart, vend) that the BIOS
+// reports as usable RAM, skipping any holes.
 void
 freerange(void *vstart, void *vend)
 {
-	char *p;
-	// A PTE can only refer to a physical address that
-	// is aligned on a 4096-byte boundary (is a multiple
-	// of 4096), so we use PGROUNDUP to ensure that we
-	// free only aligned physical addresses.
-	p = (char*)PGROUNDUP((uint)vstart);
-	// For each page...
-	for ( ; p + PGSIZE <= (char*)vend; p += PGSIZE)
-		// Add memory to the free list
-		kfree(p);
+	char *p, *e;
+	uint start, end;
+	int i;
+
+	for (i = 0; memrange(i, &start, &end); i++)
+	{
+		// Clip the usable range to [vstart, vend).
+		// A PTE can only refer to a physical address that
+		// is aligned on a 4096-byte boundary (is a multiple
+		// of 4096), so we use PGROUNDUP to ensure that we
+		// free only aligned physical addresses.
+		p = (char*)PGROUNDUP((uint)vstart);
+		if (p < (char*)P2V(start))
+			p = P2V(start);
+		e = vend;
+		if (e > (char*)P2V(end))
+			e = P2V(end);
+		// For each page...
+		for ( ; p + PGSIZE <= e; p += PGSIZE)
+			// Add memory to the free list
+			kfree(p);
+	}
+}
+
+
+// Push the block at pfn onto the free list for order.
+// Caller must hold kmem.lock (or be running before kinit2).
+static void
+blockpush(uint pfn, int order)
+{
+	struct run *r;
+
+	r = (struct run*)PFN2V(pfn);
+	r->prev = 0;
+	r->next = kmem.freelist[order];
+	if (r->next)
+		r->next->prev = r;
+	kmem.freelist[order] = r;
+	kmem.nblocks[order]++;
+	pages[pfn].free = 1;
+	pages[pfn].order = order;
+}
+
+
+// Unlink the free block at pfn from the free list for order.
+static void
+blockremove(uint pfn, int order)
+{
+	struct run *r;
+
+	r = (struct run*)PFN2V(pfn);
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		kmem.freelist[order] = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	kmem.nblocks[order]--;
+	pages[pfn].free = 0;
+}
+
+
+// Return the block of 2^order pages at pfn to the buddy
+// allocator, merging it with its buddy for as long as the
+// buddy is also a whole free block of the same order.
+static void
+buddyfree(uint pfn, int order)
+{
+	uint bpfn;
+
+	kmem.nfree += 1 << order;
+	while (order < MAXORDER)
+	{
+		bpfn = pfn ^ (1 << order);
+		if (bpfn >= npages || !pages[bpfn].free || pages[bpfn].order != order)
+			break;
+		blockremove(bpfn, order);
+		pfn &= ~(1 << order);
+		order++;
+		kmem.merges++;
+	}
+	blockpush(pfn, order);
+}
+
+
+// Take a block of 2^order pages from the smallest free
+// list that has one, splitting larger blocks in half and
+// freeing the upper halves on the way down.
+// Returns 0 if no block is large enough.
+static char*
+buddyalloc(int order)
+{
+	struct run *r;
+	uint pfn;
+	int k;
+
+	for (k = order; k <= MAXORDER; k++)
+		if (kmem.freelist[k])
+			break;
+	if (k > MAXORDER)
+		return 0;
+
+	r = kmem.freelist[k];
+	pfn = PFN(r);
+	blockremove(pfn, k);
+	while (k > order)
+	{
+		k--;
+		blockpush(pfn + (1 << k), k);
+		kmem.splits++;
+	}
+	kmem.nfree -= 1 << order;
+	pages[pfn].ref = 1;
+	return (char*)r;
+}
+
+
+// Move up to n pages from the buddy allocator to kc.
+// Returns the number of pages moved.
+static int
+kcrefill(struct kcache *kc, int n)
+{
+	struct run *r;
+	int i;
+
+	acquire(&kmem.lock);
+	for (i = 0; i < n && (r = (struct run*)buddyalloc(0)) != 0; i++)
+	{
+		r->next = kc->freelist;
+		kc->freelist = r;
+	}
+	release(&kmem.lock);
+
+	kc->nfree += i;
+	if (i > 0)
+		kc->refills++;
+	return i;
+}
+
+
+// Move n pages from kc back to the buddy allocator.
+static void
+kcdrain(struct kcache *kc, int n)
+{
+	struct run *r;
+	int i;
+
+	acquire(&kmem.lock);
+	for (i = 0; i < n && (r = kc->freelist) != 0; i++)
+	{
+		kc->freelist = r->next;
+		buddyfree(PFN(r), 0);
+	}
+	release(&kmem.lock);
+
+	kc->nfree -= i;
+	kc->drains++;
+}
+
+
+// Drop one reference to the page at pfn and
+// return the number left.
+static int
+kderef(uint pfn)
+{
+	struct spinlock *lk;
+	int n;
+
+	lk = &reflock[pfn % NREFLOCK];
+	acquire(lk);
+	n = --pages[pfn].ref;
+	release(lk);
+	return n;
+}
+
+
+// Add a reference to the allocated page at v,
+// so that it takes one more kfree() to free it.
+void
+kref(char *v)
+{
+	struct spinlock *lk;
+	uint pfn;
+
+	pfn = PFN(v);
+	if ((uint)v % PGSIZE || v < kstart || pfn >= npages || pages[pfn].ref < 1)
+		panic("kref");
+	lk = &reflock[pfn % NREFLOCK];
+	acquire(lk);
+	pages[pfn].ref++;
+	release(lk);
+}
+
+
+// Return roughly how many pages are free, counting those
+// in the buddy allocator and the zeroed pool but not the
+// per-CPU caches. No lock: the answer is only a hint.
+uint
+kfreepages(void)
+{
+	return kmem.nfree + kzero.nfree;
+}
+
+
+// Return the number of references to the page at v.
+int
+krefcount(char *v)
+{
+	return pages[PFN(v)].ref;
 }
 
 
@@ -71,10 +372,19 @@ void
 kfree(char *v)
 {
 	struct run *r;
+	struct kcache *kc;
 
-	if ((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+	if ((uint)v % PGSIZE || v < kstart || V2P(v) >= phystop)
 		panic("kfree");
 
+	// Drop a reference; only the last one frees the page.
+	// A page with a single reference has a single owner,
+	// the caller, so no one else can be changing its count.
+	if (pages[PFN(v)].ref > 1 && kderef(PFN(v)) > 0)
+		return;
+	pages[PFN(v)].ref = 0;
+
+#ifdef KJUNK
 	// Fill with junk to catch dangling refs.
 	// Sets every byte in the memory being
 	// freed to the value 1. This will cause
@@ -83,20 +393,85 @@ kfree(char *v)
 	// garbage instead of the old valid contents.
 	// Hopefully, this will cause such code to
 	// break faster.
+	// Only done in debug builds (see Makefile),
+	// since it touches every page a second time.
 	memset(v, 1, PGSIZE);
-
-	if(kmem.use_lock)
-		acquire(&kmem.lock);
+#endif
 
 	// Cast v to a pointer to a struct run
 	r = (struct run*)v;
-	// Record the old start of the free list
-	r->next = kmem.freelist;
-	// Set the free list equal to r
-	kmem.freelist = r;
 
-	if (kmem.use_lock)
-		release(&kmem.lock);
+	// Before kinit2() there is a single CPU
+	// and no locking; free straight to kmem.
+	if (!kmem.use_lock)
+	{
+		buddyfree(PFN(v), 0);
+		return;
+	}
+
+	// Push the page onto this CPU's cache, first
+	// making room by handing a batch back to kmem
+	// if the cache is full.
+	pushcli();
+	kc = &kcaches[cpu - cpus];
+	if (kc->nfree >= KCACHE_SIZE)
+		kcdrain(kc, KCACHE_BATCH);
+	r->next = kc->freelist;
+	kc->freelist = r;
+	kc->nfree++;
+	popcli();
+}
+
+
+// Take a page from this CPU's cache, refilling
+// it from the buddy allocator if it is empty.
+// Pages sitting in other CPUs' caches are not
+// stolen, so this can fail with up to
+// (ncpu-1)*KCACHE_SIZE pages still free.
+static char*
+kcalloc(void)
+{
+	struct run *r;
+	struct kcache *kc;
+
+	pushcli();
+	kc = &kcaches[cpu - cpus];
+	if (kc->freelist)
+		kc->hits++;
+	else
+	{
+		kc->misses++;
+		kcrefill(kc, KCACHE_BATCH);
+	}
+	r = kc->freelist;
+	if (r)
+	{
+		kc->freelist = r->next;
+		kc->nfree--;
+		pages[PFN(r)].ref = 1;
+	}
+	popcli();
+	return (char*)r;
+}
+
+
+// Take a page from the zeroed pool, or return 0
+// if it is empty. The page is entirely zero.
+static char*
+kzeropop(void)
+{
+	struct run *r;
+
+	acquire(&kzero.lock);
+	if ((r = kzero.freelist) != 0)
+	{
+		kzero.freelist = r->next;
+		kzero.nfree--;
+	}
+	release(&kzero.lock);
+	if (r)
+		r->next = 0;
+	return (char*)r;
 }
 
 
@@ -105,21 +480,185 @@ kfree(char *v)
 // Returns 0 if the memory cannot be allocated
 char*
 kalloc(void)
+{
+	char *v;
+
+	if (!kmem.use_lock)
+		return buddyalloc(0);
+
+	// Fall back on the zeroed pool before
+	// declaring that memory has run out.
+	if ((v = kcalloc()) == 0)
+		v = kzeropop();
+	return v;
+}
+
+
+// Allocate one zero-filled page, preferably from the
+// pool that kzeroidle() fills ahead of time.
+// Returns 0 if the memory cannot be allocated
+char*
+kalloc_zeroed(void)
+{
+	char *v;
+
+	if (kmem.use_lock && (v = kzeropop()) != 0)
+	{
+		kzero.hits++;
+		return v;
+	}
+	if ((v = kalloc()) == 0)
+		return 0;
+	kzero.misses++;
+	memset(v, 0, PGSIZE);
+	return v;
+}
+
+
+// Zero one free page into the kzero pool, if it is
+// not full. Called by scheduler() when this CPU finds
+// no process to run, so each call does a bounded
+// amount of work before the CPU looks again.
+void
+kzeroidle(void)
 {
 	struct run *r;
 
-	if(kmem.use_lock)
+	if (!kmem.use_lock || kzero.nfree >= ZPOOL_SIZE)
+		return;
+	if ((r = (struct run*)kcalloc()) == 0)
+		return;
+	memset(r, 0, PGSIZE);
+
+	acquire(&kzero.lock);
+	r->next = kzero.freelist;
+	kzero.freelist = r;
+	kzero.nfree++;
+	release(&kzero.lock);
+}
+
+
+// Allocate 2^order physically contiguous pages, aligned
+// on a 2^order page boundary. Single pages come from
+// kalloc() so that they go through the per-CPU caches.
+// Returns 0 if no large enough block is free.
+char*
+kalloc_pages(int order)
+{
+	char *v;
+
+	if (order < 0 || order > MAXORDER)
+		panic("kalloc_pages");
+	if (order == 0)
+		return kalloc();
+
+	if (kmem.use_lock)
 		acquire(&kmem.lock);
-	// Remove the first element in the free list
-	r = kmem.freelist;
-	// If successful, make the next element in the
-	// free list the new head of the list.
-	if (r)
-		kmem.freelist = r->next;
+	v = buddyalloc(order);
+	if (kmem.use_lock)
+		release(&kmem.lock);
+	return v;
+}
+
+
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(char *v, int order)
+{
+	if (order < 0 || order > MAXORDER)
+		panic("kfree_pages");
+	if (order == 0)
+	{
+		kfree(v);
+		return;
+	}
+	if ((uint)v % (PGSIZE << order) || v < kstart ||
+			V2P(v) + (PGSIZE << order) > phystop)
+		panic("kfree_pages");
+
+#ifdef KJUNK
+	// Fill with junk to catch dangling refs (see kfree).
+	memset(v, 1, PGSIZE << order);
+#endif
 
+	pages[PFN(v)].ref = 0;
+	if (kmem.use_lock)
+		acquire(&kmem.lock);
+	buddyfree(PFN(v), order);
 	if (kmem.use_lock)
 		release(&kmem.lock);
-	// Return the element
-	return (char*)r;
 }
 
+
+// Turn a block returned by kalloc_pages(order) into 2^order
+// separate pages, each with one reference, so that they
+// can be shared and freed one at a time with kfree().
+void
+ksplit(char *v, int order)
+{
+	uint pfn;
+
+	if (order < 0 || order > MAXORDER || (uint)v % (PGSIZE << order) ||
+			v < kstart || pages[PFN(v)].ref != 1)
+		panic("ksplit");
+	for (pfn = PFN(v); pfn < PFN(v) + (1 << order); pfn++)
+		pages[pfn].ref = 1;
+}
+
+
+// Return part as a percentage of whole without
+// overflowing 32 bits (there is no libgcc for
+// 64-bit division in the kernel).
+static int
+percent(uint part, uint whole)
+{
+	if (whole == 0)
+		return 0;
+	if (part < 0x1000000)
+		return part * 100 / whole;
+	return part / (whole / 100);
+}
+
+
+// Print allocator statistics to the console. FOR DEBUGGING.
+// Runs when a user types ^P on console, after procdump().
+// No lock, like procdump(), so the numbers may be slightly stale.
+void
+kmemdump(void)
+{
+	struct kcache *kc;
+	uint total;
+	int i, maxfree;
+
+	// The largest free order bounds the biggest
+	// contiguous request that can succeed right now;
+	// the share of free pages held in blocks of that
+	// order shows how fragmented the rest is.
+	maxfree = -1;
+	for (i = 0; i <= MAXORDER; i++)
+		if (kmem.nblocks[i])
+			maxfree = i;
+	cprintf("kmem: %d free pages, largest free order %d "
+			"(%d%% of free pages), splits %d merges %d\n",
+			kmem.nfree, maxfree,
+			maxfree < 0 ? 0 :
+			percent(kmem.nblocks[maxfree] << maxfree, kmem.nfree),
+			kmem.splits, kmem.merges);
+	cprintf("kzero: %d zeroed pages, hits %d misses %d (%d%% hit)\n",
+			kzero.nfree, kzero.hits, kzero.misses,
+			percent(kzero.hits, kzero.hits + kzero.misses));
+	cprintf("kmem: free blocks by order:");
+	for (i = 0; i <= MAXORDER; i++)
+		cprintf(" %d", kmem.nblocks[i]);
+	cprintf("\n");
+	for (i = 0; i < ncpu; i++)
+	{
+		kc = &kcaches[i];
+		total = kc->hits + kc->misses;
+		cprintf("cpu%d: kcache %d pages, hits %d misses %d (%d%% hit), "
+				"refills %d drains %d\n",
+				i, kc->nfree, kc->hits, kc->misses,
+				percent(kc->hits, total),
+				kc->refills, kc->drains);
+	}
+}
@@ -141,6 +141,17 @@ lapiceoi(void)
 }
 
 
+// Send interrupt vector to the CPU whose APIC ID is apicid.
+void
+lapicipi(uchar apicid, int vector)
+{
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, FIXED | ASSERT | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+
 // Spin for a given number of microseconds.
 // On real hardware, we would want to tune this dynamically.
 void
@@ -19,7 +19,9 @@ main(void)
 {
 	// Initialize the physical page allocator, at least partially.
 	// Right now main() cannot use locks or memory above 4Mb.
-	// Set up lock-less allocation in the first 4Mb.
+	// Set up lock-less allocation in the first 4Mb,
+	// after finding out how much memory there is.
+	e820init();
 	kinit1(end, P2V(4*1024*1024));
 
 	// The page table created by 'entry' has enough mappings to
@@ -28,6 +30,7 @@ main(void)
 	// in order to carry out a more elaborate plan for
 	// describing process address space.
 	kvmalloc();
+	slabinit();			// small object allocator
 
 	mpinit();			// detect other processors
 	lapicinit();		// interrupt controller
@@ -46,7 +49,11 @@ main(void)
 	tvinit();			// trap vectors
 
 	binit();			// buffer cache
+	pcacheinit();		// file page cache
 	fileinit();			// file table
+	pipeinit();			// pipe cache
+	shminit();			// shared memory segments
+	futexinit();		// futex wait queues
 
 	// The kernel now initializes the disk driver
 	ideinit();
@@ -60,9 +67,9 @@ main(void)
 	// Enable locking and arrange for more memory to be allocatable.
 	// The physical allocator refers to physical pages by their
 	// virtual addresses, as mapped in high memory, not by their
-	// physical addresses, so P2V is used to translate PHYSTOP
+	// physical addresses, so P2V is used to translate phystop
 	// (a physical address) to a virtual address.
-	kinit2(P2V(4*1024*1024), P2V(PHYSTOP));		// must come after startothers()
+	kinit2(P2V(4*1024*1024), P2V(phystop));		// must come after startothers()
 	userinit();			// first user process
 	mpmain();			// finish this processor's setup
 }
@@ -1,13 +1,18 @@
 // Memory Layout
 
 #define EXTMEM		0x100000		// Start of extended memory
-#define PHYSTOP		0xE000000		// Top physical memory
+#define PHYSTOP		0xE000000		// Top physical memory, if the BIOS has no map
 #define DEVSPACE	0xFE000000		// Other devices are at high addresses
+#define E820MAP		0x8000			// BIOS memory map saved by bootasm.S
+#define NE820		32				// max entries in it
 
 // Key addresses for address space layout
 // (see kmap in vm.c for layout)
 #define KERNBASE	0x80000000			// First kernel virtual address
 #define KERNLINK	(KERNBASE+EXTMEM)	// Address where kernel is linked
+#define PHYSLIMIT	(DEVSPACE-KERNBASE)	// Most physical memory the kernel can map
+#define MMAPBASE	0x40000000			// mmap() regions go here; user image ends below
+#define SHMBASE		0x7F000000			// Shared memory attaches here; mmap() ends below
 
 // Macros to map virtual memory to and from physical memory
 #define V2P(a) (((uint) (a)) - KERNBASE)
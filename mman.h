@@ -0,0 +1,5 @@
+#define PROT_READ		0x1		// mmap() prot: pages may be read
+#define PROT_WRITE		0x2		// pages may be written
+
+#define MAP_SHARED		0x1		// mmap() flags: writes go to the file
+#define MAP_PRIVATE		0x2		// writes stay in the process
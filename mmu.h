@@ -38,6 +38,7 @@
 #define CR0_PG			0x80000000		// Paging
 
 #define CR4_PSE			0x00000010		// Page size extension
+#define CR4_PGE			0x00000080		// Page global enable
 
 // various segment selectors
 #define SEG_KCODE	1	// kernel code
@@ -124,6 +125,7 @@ struct segdesc {
 #define NPDENTRIES		1024		// directory entries per page directory
 #define NPTENTRIES		1024		// PTEs per page table
 #define PGSIZE			4096		// bytes mapped by a page
+#define PDSIZE			(PGSIZE*NPTENTRIES)	// bytes mapped by a directory entry
 
 #define PGSHIFT			12			// log2(PGSIZE)
 #define PTXSHIFT		12			// offset of PTX in a linear address
@@ -131,6 +133,7 @@ struct segdesc {
 
 #define PGROUNDUP(sz)	(((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a)	(((a)) & ~(PGSIZE-1))
+#define PDROUNDUP(sz)	(((sz)+PDSIZE-1) & ~(PDSIZE-1))
 
 // Page table/directory entry flags
 #define PTE_P			0x001		// Present
@@ -141,7 +144,10 @@ struct segdesc {
 #define PTE_A			0x020		// Accessed
 #define PTE_D			0x040		// Dirty
 #define PTE_PS			0x080		// Page Size
+#define PTE_G			0x100		// Global: kept in the TLB across lcr3()
 #define PTE_MBZ			0x180		// bits Must Be Zero
+#define PTE_COW			0x200		// Copy-on-write (AVL bit, software only)
+#define PTE_SWAP		0x400		// Not present: swapped out to slot PTE_ADDR>>12 (AVL bit)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((uint)(pte) & ~0xFFF)
@@ -2,6 +2,10 @@
 #define KSTACKSIZE		4096	// size of per-process kernel stack
 #define NCPU			8		// maximum number of CPUs
 #define NOFILE			16		// open files per process
+#define NVMA			16		// file-backed memory regions per process
+#define NSHM			16		// shared memory segments per system
+#define NSHMPROC		4		// shared memory segments attached per process
+#define SHMPAGES		64		// max pages in a shared memory segment
 #define NFILE			100		// open files per system
 #define NINODE			50		// max number of active inodes
 #define NDEV			10		// max major device number
@@ -10,4 +14,11 @@
 #define MAXOPBLOCKS		10		// max number of blocks any fs op writes
 #define LOGSIZE	(MAXOPBLOCKS*3)	// max data blocks in on-disk log
 #define NBUF	(MAXOPBLOCKS*3)	// size of disk block cache
+#define NPCACHE			256		// size of file page cache, in pages
 #define FSSIZE			1000	// size of file system in blocks
+#define SWAPBLOCKS		8192	// size of swap area in blocks, after the file system
+#define NMLFQ			3		// priority levels of the MLFQ scheduler
+#define BOOSTTICKS		100		// ticks between MLFQ priority boosts
+#define DEFTICKETS		100		// stride scheduler tickets of a new process
+#define MAXTICKETS		1000	// most tickets a process may have
+#define MAXORDER		10		// largest kalloc_pages() block is 2^MAXORDER pages
@@ -0,0 +1,324 @@
+// File page cache.
+//
+// The page cache holds whole pages of file contents, so
+// that processes running the same program, or mapping the
+// same file with mmap(), can share the physical pages
+// instead of each reading a private copy from disk. A
+// process that maps a cached page holds a kref() reference
+// on it; the cache holds one more.
+//
+// Interface:
+// * to get the page of file ip starting at offset off,
+//		call pcread(), with ip locked.
+// * when done with the page, call pcrelse()
+// * writei() calls pcwrite() to keep cached pages up to
+//		date, so that mappings see write()s to the file.
+// * itrunc() calls pcinval() to forget a file's pages.
+//
+// A page is only ever filled or written with its inode
+// locked, so the inode lock orders all users of a page.
+//
+// Like the buffer cache, the entries sit on an LRU list
+// and the least recently used idle one is recycled on a
+// miss. A page that some process maps is never recycled,
+// so that every mapping of a file page is of the same
+// page; if every entry is mapped or in use, the cache
+// grows by one from kmalloc(). It starts with NPCACHE
+// entries and never shrinks. Lookups go through a hash
+// on (dev, inum, off).
+// Offsets need not be page aligned: a program segment
+// starts wherever the linker put it in the file.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "pcache.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define NPCHASH		61		// hash buckets, prime
+#define PCHASH(dev, inum, off)	(((dev) + (inum)*7 + (off)/PGSIZE) % NPCHASH)
+
+struct {
+	struct spinlock lock;
+	struct cpage page[NPCACHE];
+	struct cpage *hash[NPCHASH];
+
+	// Linked list of all entries, through prev/next.
+	//	- head.next is the most recently used
+	struct cpage head;
+
+	uint n;					// entries, NPCACHE or more
+
+	// Statistics
+	uint hits;
+	uint misses;
+	uint invals;
+} pcache;
+
+
+// Put a new, unused entry at the head of the list.
+// Caller must hold pcache.lock, or be pcacheinit().
+static void
+pcadd(struct cpage *cp)
+{
+	cp->next = pcache.head.next;
+	cp->prev = &pcache.head;
+	initsleeplock(&cp->lock, "cpage");
+	pcache.head.next->prev = cp;
+	pcache.head.next = cp;
+	pcache.n++;
+}
+
+
+void
+pcacheinit(void)
+{
+	struct cpage *cp;
+
+	initlock(&pcache.lock, "pcache");
+
+	pcache.head.prev = &pcache.head;
+	pcache.head.next = &pcache.head;
+	for (cp = pcache.page; cp < pcache.page+NPCACHE; cp++)
+		pcadd(cp);
+}
+
+
+// Take cp off its hash chain. Caller must hold pcache.lock.
+// Only entries with inum != 0 are on a chain.
+static void
+hashremove(struct cpage *cp)
+{
+	struct cpage **pp;
+
+	for (pp = &pcache.hash[PCHASH(cp->dev, cp->inum, cp->off)]; *pp; pp = &(*pp)->hnext)
+	{
+		if (*pp == cp)
+		{
+			*pp = cp->hnext;
+			break;
+		}
+	}
+	cp->hnext = 0;
+	cp->inum = 0;
+	cp->flags = 0;
+}
+
+
+// Look for the page of ip at off in the cache. If not
+// found, recycle an idle entry, or add one. In either
+// case, return a locked entry with a data page, or 0 if
+// there is no memory.
+static struct cpage*
+pcget(struct inode *ip, uint off)
+{
+	struct cpage *cp;
+	uint h;
+
+	h = PCHASH(ip->dev, ip->inum, off);
+	acquire(&pcache.lock);
+
+	// Is the page already cached?
+	for (cp = pcache.hash[h]; cp; cp = cp->hnext)
+	{
+		if (cp->dev == ip->dev && cp->inum == ip->inum && cp->off == off)
+		{
+			cp->refcnt++;
+			pcache.hits++;
+			release(&pcache.lock);
+			acquiresleep(&cp->lock);
+			return cp;
+		}
+	}
+
+	// Not cached; recycle the least recently used idle entry.
+	for (cp = pcache.head.prev; cp != &pcache.head; cp = cp->prev)
+	{
+		if (cp->refcnt != 0)
+			continue;
+		if (cp->data && krefcount(cp->data) > 1)
+		{
+			// Still mapped: keep it cached.
+			if (cp->inum)
+				continue;
+			// Stale (see pcinval); leave the old
+			// page to the processes that map it.
+			kfree(cp->data);
+			cp->data = 0;
+		}
+		break;
+	}
+
+	// None idle: every entry is mapped or in use.
+	if (cp == &pcache.head)
+	{
+		if ((cp = kmalloc(sizeof(*cp))) == 0)
+		{
+			release(&pcache.lock);
+			return 0;
+		}
+		memset(cp, 0, sizeof(*cp));
+		pcadd(cp);
+	}
+
+	if (cp->inum)
+		hashremove(cp);
+	if (cp->data == 0 && (cp->data = kalloc()) == 0)
+	{
+		release(&pcache.lock);
+		return 0;
+	}
+	cp->dev = ip->dev;
+	cp->inum = ip->inum;
+	cp->off = off;
+	cp->flags = 0;
+	cp->refcnt = 1;
+	cp->hnext = pcache.hash[h];
+	pcache.hash[h] = cp;
+	pcache.misses++;
+	release(&pcache.lock);
+	acquiresleep(&cp->lock);
+	return cp;
+}
+
+
+// Return a locked entry holding the page of ip at off,
+// read from the file, zero past its end.
+// Returns 0 if the cache is full.
+// Caller must hold ip's lock.
+struct cpage*
+pcread(struct inode *ip, uint off)
+{
+	struct cpage *cp;
+	uint n;
+
+	if (!holdingsleep(&ip->lock))
+		panic("pcread");
+	if ((cp = pcget(ip, off)) == 0)
+		return 0;
+	if (!(cp->flags & PC_VALID))
+	{
+		memset(cp->data, 0, PGSIZE);
+		n = off < ip->size ? min(ip->size - off, PGSIZE) : 0;
+		readblocks(ip, cp->data, off, n);
+		cp->flags |= PC_VALID;
+	}
+	return cp;
+}
+
+
+// Release a locked entry.
+// Move to the head of the MRU list.
+void
+pcrelse(struct cpage *cp)
+{
+	if (!holdingsleep(&cp->lock))
+		panic("pcrelse");
+
+	releasesleep(&cp->lock);
+
+	acquire(&pcache.lock);
+	cp->refcnt--;
+	if (cp->refcnt == 0)
+	{
+		cp->next->prev = cp->prev;
+		cp->prev->next = cp->next;
+		cp->next = pcache.head.next;
+		cp->prev = &pcache.head;
+		pcache.head.next->prev = cp;
+		pcache.head.next = cp;
+	}
+	release(&pcache.lock);
+}
+
+
+// Copy the n bytes at src, just written to ip at off,
+// into every cached page of ip that they overlap.
+// Caller must hold ip's lock, so no page is being filled.
+// A page that overlaps them starts less than PGSIZE
+// before off, so only the hash chains for page numbers
+// first..last need searching; NPCHASH of them in a row
+// are all the chains.
+void
+pcwrite(struct inode *ip, char *src, uint off, uint n)
+{
+	struct cpage *cp;
+	uint lo, hi, first, last, pn;
+
+	if (n == 0)
+		return;
+	first = off < PGSIZE ? 0 : (off - PGSIZE + 1) / PGSIZE;
+	last = (off + n - 1) / PGSIZE;
+	if (last - first >= NPCHASH)
+		last = first + NPCHASH - 1;
+
+	acquire(&pcache.lock);
+	for (pn = first; pn <= last; pn++)
+	{
+		for (cp = pcache.hash[PCHASH(ip->dev, ip->inum, pn*PGSIZE)]; cp; cp = cp->hnext)
+		{
+			if (cp->inum == ip->inum && cp->dev == ip->dev && (cp->flags & PC_VALID) &&
+					cp->off < off + n && off < cp->off + PGSIZE)
+			{
+				lo = max(off, cp->off);
+				hi = min(off + n, cp->off + PGSIZE);
+				memmove(cp->data + (lo - cp->off), src + (lo - off), hi - lo);
+			}
+		}
+	}
+	release(&pcache.lock);
+}
+
+
+// Forget any cached pages of ip that overlap the n
+// bytes at off, because the file no longer holds them.
+// An entry that is locked right now is dropped from
+// the hash as well; its holder may finish with it, but
+// no one will find it again.
+void
+pcinval(struct inode *ip, uint off, uint n)
+{
+	struct cpage *cp;
+
+	acquire(&pcache.lock);
+	for (cp = pcache.head.next; cp != &pcache.head; cp = cp->next)
+	{
+		if (cp->inum == ip->inum && cp->dev == ip->dev &&
+				cp->off < off + n && off < cp->off + PGSIZE)
+		{
+			hashremove(cp);
+			pcache.invals++;
+		}
+	}
+	release(&pcache.lock);
+}
+
+
+// Print page cache usage to the console. FOR DEBUGGING.
+// Runs when a user types ^P on console.
+// No lock, like procdump().
+void
+pcachedump(void)
+{
+	struct cpage *cp;
+	int n, shared;
+
+	n = shared = 0;
+	for (cp = pcache.head.next; cp != &pcache.head; cp = cp->next)
+	{
+		if (cp->inum == 0)
+			continue;
+		n++;
+		if (cp->data && krefcount(cp->data) > 1)
+			shared++;
+	}
+	cprintf("pcache: %d/%d pages, %d mapped, %d hits, %d misses, %d invalidated\n",
+			n, pcache.n, shared, pcache.hits, pcache.misses, pcache.invals);
+}
@@ -0,0 +1,18 @@
+// xv6 caches whole pages of file contents using struct cpage
+
+struct cpage {
+	int flags;				// PC_VALID
+	uint dev;				// device number
+	uint inum;				// inode number, 0 if unused
+	uint off;				// file offset of data[0]
+	struct sleeplock lock;	// held between pcget() and pcrelse()
+	uint refcnt;
+	struct cpage *prev;		// LRU cache list
+	struct cpage *next;
+	struct cpage *hnext;	// hash chain
+	char *data;				// one page from kalloc(), or 0
+};
+
+// FLAGS
+
+#define PC_VALID	0x2		// data holds the file contents at off
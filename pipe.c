@@ -19,6 +19,14 @@ struct pipe {
 	int writeopen;	// write fd is still open
 };
 
+static struct kmcache *pipecache;
+
+void
+pipeinit(void)
+{
+	pipecache = kmcache_create("pipe", sizeof(struct pipe));
+}
+
 
 int
 pipealloc(struct file **f0, struct file **f1)
@@ -29,7 +37,7 @@ pipealloc(struct file **f0, struct file **f1)
 	*f0 = *f1 = 0;
 	if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
 		goto bad;
-	if ((p = (struct pipe*)kalloc()) == 0)
+	if ((p = (struct pipe*)kmcache_alloc(pipecache)) == 0)
 		goto bad;
 	p->readopen = 1;
 	p->writeopen = 1;
@@ -48,7 +56,7 @@ pipealloc(struct file **f0, struct file **f1)
 
 bad:
 	if(p)
-		kfree((char*)p);
+		kmfree(p);
 	if(*f0)
 		fileclose(*f0);
 	if(*f1)
@@ -75,7 +83,7 @@ pipeclose(struct pipe *p, int writable)
 	if (p->readopen == 0 && p->writeopen == 0)
 	{
 		release(&p->lock);
-		kfree((char*)p);
+		kmfree(p);
 	}
 	else
 		release(&p->lock);
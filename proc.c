@@ -6,11 +6,94 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
-
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "traps.h"
+
+
+// The scheduling policy is chosen when the kernel is built
+// (see SCHED in the Makefile). Round robin runs processes in
+// turn for a tick each. The multi-level feedback queue runs
+// the processes at the highest priority level first, and
+// moves one down a level once it has used up QUANTUM ticks
+// there, however many times it slept in between; every
+// BOOSTTICKS ticks all processes go back up to the top,
+// so that none starves. The stride scheduler shares the CPUs
+// in proportion to the processes' tickets: each tick a
+// process runs advances its pass by its stride, inversely
+// proportional to its tickets, and the process with the
+// lowest pass runs next. Its one run queue, kept sorted by
+// pass, is shared by all CPUs, so that passes compare.
+#ifdef SCHED_MLFQ
+#define NLEVEL		NMLFQ
+#define QUANTUM(l)	(1 << (l))		// ticks a process runs at level l
+#else
+#define NLEVEL		1
+#endif
+
+#define STRIDE1		(1 << 20)		// stride of a process with one ticket
+
+#ifdef SCHED_STRIDE
+#define MYRUNQ()	(&ptable.runq[0])
+#else
+#define MYRUNQ()	(&ptable.runq[cpu - cpus])
+#endif
+
+// Real-time processes (see setrealtime) run ahead of all
+// others, whatever the policy, earliest deadline first,
+// from one queue shared by all CPUs and sorted by deadline.
+#define RTQ			(&ptable.runq[NCPU])
+#define RTSCALE		1000			// fixed point for CPU utilization
+
+// Sleeping processes hang off a hash of their wait channels,
+// through cnext, so that wakeup() need only look at the
+// processes that might be sleeping on its channel. Each
+// bucket has its own lock, taken before any process lock.
+#define NCHANHASH	61				// hash buckets, prime
+#define CHANHASH(chan)	(&ptable.chan[((uint)(chan) / sizeof(int)) % NCHANHASH])
+
+struct chanq {
+	struct spinlock lock;
+	struct proc *head;
+};
+
+// Each process has a lock, PLOCK(p), that guards its state
+// and, while it is held by scheduler() or sched(), its
+// context: a CPU switching to or away from p holds it
+// across swtch(). Processes on different CPUs thus go to
+// sleep, wake up and switch without contending for any
+// one lock. ptable.lock is left for allocating processes,
+// address spaces and file tables, and for the parent and
+// child links that exit() and wait() use; it is taken
+// before any process lock.
+#define PLOCK(p)	(&ptable.plock[(p) - ptable.proc])
+
+// Run queue of RUNNABLE processes, through rnext, oldest
+// first at each priority level, or under the stride
+// scheduler, lowest pass first. Each CPU has one; a process
+// is on exactly one of them if and only if it is RUNNABLE.
+// Changing a queue takes its lock, after the lock of the
+// process if that is needed too. n may be read without the
+// lock, as a hint.
+struct runq {
+	struct spinlock lock;
+	struct proc *head[NLEVEL];
+	struct proc *tail[NLEVEL];
+	volatile int n;
+	uint pass;		// pass of the process last taken (stride)
+};
 
 struct {
 	struct spinlock lock;
 	struct proc proc[NPROC];
+	struct spinlock plock[NPROC];	// PLOCK(p) for each proc
+	struct aspace as[NPROC];
+	struct fdtable fdt[NPROC];
+	struct runq runq[NCPU+1];	// indexed like cpus[], then RTQ
+	struct spinlock boostlock;
+	uint boosted;				// ticks at the last priority boost
+	struct chanq chan[NCHANHASH];	// SLEEPING processes, by chan
 } ptable;
 
 static struct proc *initproc;
@@ -19,12 +102,497 @@ int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
-
 void
 pinit(void)
 {
+	int i;
+
 	initlock(&ptable.lock, "ptable");
+	initlock(&ptable.boostlock, "boost");
+	for (i = 0; i < NCPU+1; i++)
+		initlock(&ptable.runq[i].lock, "runq");
+	for (i = 0; i < NPROC; i++)
+	{
+		initlock(&ptable.plock[i], "proc");
+		initlock(&ptable.fdt[i].lock, "fdtable");
+	}
+	for (i = 0; i < NCHANHASH; i++)
+		initlock(&ptable.chan[i].lock, "chan");
+}
+
+
+// May p run on CPU c? (see setaffinity)
+#define ALLOWED(p, c)	((p)->affinity & (1 << ((c) - cpus)))
+
+// Start a new period of real-time process p if the
+// current one is over, with a fresh budget.
+// Caller must hold PLOCK(p), or be p.
+static void
+rtreplenish(struct proc *p)
+{
+	if ((int)(ticks - p->rtnext) >= 0)
+	{
+		p->rtnext = ticks + p->rtperiod;
+		p->rtdue = ticks + p->rtdeadline;
+		p->rtbudget = p->rtruntime;
+	}
+}
+
+
+// Make real-time process p RUNNABLE, on RTQ in order
+// of deadline. Caller must hold PLOCK(p).
+static void
+rtrunnable(struct proc *p)
+{
+	struct proc **pp;
+
+	rtreplenish(p);
+	p->state = RUNNABLE;
+	acquire(&RTQ->lock);
+	for (pp = &RTQ->head[0]; *pp && (int)((*pp)->rtdue - p->rtdue) <= 0; pp = &(*pp)->rnext)
+		;
+	p->rnext = *pp;
+	*pp = p;
+	if (p->rnext == 0)
+		RTQ->tail[0] = p;
+	RTQ->n++;
+	release(&RTQ->lock);
+}
+
+
+// Make p RUNNABLE and put it on a run queue: that of the
+// CPU it last ran on, to find its cache still warm, unless
+// the current CPU, the one waking it up, has fewer processes
+// waiting. Either must be one that p may run on; if neither
+// is, take the least busy one that is.
+// Caller must hold PLOCK(p).
+static void
+setrunnable(struct proc *p)
+{
+	struct runq *rq;
+#ifdef SCHED_STRIDE
+	struct proc **pp;
+#else
+	struct runq *q;
+	int i;
+#endif
+
+	if (p->rtperiod)
+	{
+		rtrunnable(p);
+		return;
+	}
+
+	rq = MYRUNQ();
+#ifndef SCHED_STRIDE
+	if (!ALLOWED(p, cpu))
+		rq = 0;
+	q = p->lastcpu ? &ptable.runq[p->lastcpu - cpus] : 0;
+	if (q && ALLOWED(p, p->lastcpu) && (rq == 0 || q->n <= rq->n))
+		rq = q;
+	for (i = 0; rq == 0 && i < ncpu; i++)
+	{
+		q = &ptable.runq[i];
+		if (ALLOWED(p, &cpus[i]) && (rq == 0 || q->n < rq->n))
+			rq = q;
+	}
+	if (rq == 0)
+		panic("setrunnable affinity");
+#endif
+
+#ifdef SCHED_MLFQ
+	if (p->priority < p->nice)
+		p->priority = p->nice;
+#endif
+	p->state = RUNNABLE;
+	p->rnext = 0;
+	acquire(&rq->lock);
+#ifdef SCHED_STRIDE
+	// A process that slept does not get to catch up on
+	// the CPU time it did not use.
+	if ((int)(p->pass - rq->pass) < 0)
+		p->pass = rq->pass;
+	for (pp = &rq->head[0]; *pp && (int)((*pp)->pass - p->pass) <= 0; pp = &(*pp)->rnext)
+		;
+	p->rnext = *pp;
+	*pp = p;
+	if (p->rnext == 0)
+		rq->tail[0] = p;
+#else
+	if (rq->head[p->priority])
+		rq->tail[p->priority]->rnext = p;
+	else
+		rq->head[p->priority] = p;
+	rq->tail[p->priority] = p;
+#endif
+	rq->n++;
+	release(&rq->lock);
+}
+
+
+// Take the first process that may run on this CPU from the
+// highest priority level of rq that has one, or return 0.
+// Only processes restricted to other CPUs are passed over.
+// The caller takes PLOCK() of the process before running
+// it, which waits until the CPU it last ran on, if any,
+// has switched away from it.
+static struct proc*
+runqget(struct runq *rq)
+{
+	struct proc *p, **pp, *prev;
+	int l;
+
+	acquire(&rq->lock);
+	for (l = 0; l < NLEVEL; l++)
+	{
+		prev = 0;
+		for (pp = &rq->head[l]; (p = *pp) != 0; pp = &p->rnext)
+		{
+			if (ALLOWED(p, cpu))
+			{
+				if (p->state != RUNNABLE)
+					panic("runqget");
+				*pp = p->rnext;
+				if (rq->tail[l] == p)
+					rq->tail[l] = prev;
+				rq->n--;
+				rq->pass = p->pass;
+				p->rnext = 0;
+				release(&rq->lock);
+				return p;
+			}
+			prev = p;
+		}
+	}
+	release(&rq->lock);
+	return 0;
+}
+
+
+// Take RUNNABLE p off whichever run queue it is on.
+// Returns -1 if it is on none, because a scheduler has
+// just taken it to run. Caller must hold PLOCK(p).
+static int
+runqdel(struct proc *p)
+{
+	struct runq *rq;
+	struct proc **pp, *prev;
+	int l;
+
+	for (rq = ptable.runq; rq <= RTQ; rq++)
+	{
+		acquire(&rq->lock);
+		for (l = 0; l < NLEVEL; l++)
+		{
+			prev = 0;
+			for (pp = &rq->head[l]; *pp; pp = &(*pp)->rnext)
+			{
+				if (*pp == p)
+				{
+					*pp = p->rnext;
+					if (rq->tail[l] == p)
+						rq->tail[l] = prev;
+					rq->n--;
+					p->rnext = 0;
+					release(&rq->lock);
+					return 0;
+				}
+				prev = *pp;
+			}
+		}
+		release(&rq->lock);
+	}
+	return -1;
+}
+
+
+// The run queue of another CPU with the most processes
+// waiting, to steal from, or 0 if they are all empty.
+// Only a hint: the queues may change at any time.
+static struct runq*
+busiest(void)
+{
+	struct runq *rq, *max;
+
+	max = 0;
+	for (rq = ptable.runq; rq < &ptable.runq[ncpu]; rq++)
+	{
+		if (rq != MYRUNQ() && rq->n > 0 &&
+				(max == 0 || rq->n > max->n))
+			max = rq;
+	}
+	return max;
+}
+
+
+#ifdef SCHED_MLFQ
+// Put every process back at the top priority level
+// it may have, with a fresh quantum.
+static void
+boost(void)
+{
+	struct proc *p, *q, *head[NLEVEL], *tail[NLEVEL];
+	struct runq *rq;
+	int l;
+
+	acquire(&ptable.boostlock);
+	if (ticks - ptable.boosted < BOOSTTICKS)
+	{
+		release(&ptable.boostlock);
+		return;
+	}
+	ptable.boosted = ticks;
+	release(&ptable.boostlock);
+
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		acquire(PLOCK(p));
+		if (p->state != RUNNABLE)
+		{
+			p->priority = p->nice;
+			p->slice = 0;
+		}
+		release(PLOCK(p));
+	}
+
+	// Requeue the RUNNABLE ones, highest level first.
+	for (rq = ptable.runq; rq < &ptable.runq[NCPU]; rq++)
+	{
+		acquire(&rq->lock);
+		memset(head, 0, sizeof(head));
+		for (l = 0; l < NLEVEL; l++)
+		{
+			for (p = rq->head[l]; p; p = q)
+			{
+				q = p->rnext;
+				p->rnext = 0;
+				p->priority = p->nice;
+				p->slice = 0;
+				if (head[p->priority])
+					tail[p->priority]->rnext = p;
+				else
+					head[p->priority] = p;
+				tail[p->priority] = p;
+			}
+		}
+		memmove(rq->head, head, sizeof(head));
+		memmove(rq->tail, tail, sizeof(tail));
+		release(&rq->lock);
+	}
+}
+#endif
+
+
+// Charge the clock tick that interrupted the current
+// real-time process to its budget. Once that is used up,
+// sleep until the next period. Returns 1 if it should
+// yield the CPU to a process with an earlier deadline.
+static int
+rttick(void)
+{
+	int earlier;
+
+	rtreplenish(proc);
+	if (--proc->rtbudget <= 0)
+	{
+		acquire(&tickslock);
+		while ((int)(ticks - proc->rtnext) < 0 && !proc->killed)
+			sleep(&ticks, &tickslock);
+		release(&tickslock);
+		return 0;
+	}
+	acquire(&RTQ->lock);
+	earlier = RTQ->head[0] && (int)(RTQ->head[0]->rtdue - proc->rtdue) < 0;
+	release(&RTQ->lock);
+	return earlier;
+}
+
+
+// Charge the clock tick that interrupted the current
+// process to it. Returns 1 if it should yield the CPU.
+// Only the process itself changes its own slice and
+// budget while it runs, so no lock is needed; boost()
+// racing with it can at worst lose a tick.
+int
+schedtick(void)
+{
+#ifdef SCHED_MLFQ
+	struct runq *rq;
+	int l;
+#endif
+
+	if (proc->rtperiod)
+		return rttick();
+
+#ifdef SCHED_MLFQ
+
+	if (ticks - ptable.boosted >= BOOSTTICKS)
+		boost();
+
+	if (++proc->slice >= QUANTUM(proc->priority))
+	{
+		if (proc->priority < NLEVEL-1)
+			proc->priority++;
+		proc->slice = 0;
+		return 1;
+	}
+
+	// Make way for a process of higher priority.
+	rq = &ptable.runq[cpu - cpus];
+	for (l = 0; l < proc->priority; l++)
+		if (rq->head[l])
+			return 1;
+	return RTQ->n > 0;
+#else
+#ifdef SCHED_STRIDE
+	proc->pass += proc->stride;
+#endif
+	return 1;
+#endif
+}
+
+
+// Give the current process n tickets, its share of the
+// CPUs under the stride scheduler; the others ignore them.
+int
+settickets(int n)
+{
+	if (n < 1 || n > MAXTICKETS)
+		return -1;
+	proc->tickets = n;
+	proc->stride = STRIDE1 / n;
+	return 0;
+}
+
+
+// Make the current process a real-time one that needs
+// runtime ticks of CPU in every period ticks, within
+// deadline ticks of the period's start; or with runtime 0,
+// an ordinary process again. Returns 0, or -1 if the
+// parameters are bad or the CPUs could not meet the new
+// demand along with that of the real-time processes already
+// admitted. The test is that of Goossens, Funk and Baruah
+// for global EDF on ncpu CPUs: the total density must not
+// exceed ncpu - (ncpu-1) * the largest density. RTQ's lock
+// keeps two admissions from both passing it.
+int
+setrealtime(int period, int runtime, int deadline)
+{
+	struct proc *p;
+	int u, total, max;
+
+	if (runtime == 0)
+	{
+		proc->rtperiod = 0;
+		return 0;
+	}
+	if (runtime < 0 || runtime > deadline || deadline > period ||
+			period > RTSCALE*RTSCALE)
+		return -1;
+
+	total = max = (runtime*RTSCALE + deadline-1) / deadline;
+	acquire(&RTQ->lock);
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		if (p == proc || p->rtperiod == 0 || p->state == UNUSED || p->state == ZOMBIE)
+			continue;
+		u = (p->rtruntime*RTSCALE + p->rtdeadline-1) / p->rtdeadline;
+		total += u;
+		if (u > max)
+			max = u;
+	}
+	if (total > ncpu*RTSCALE - (ncpu-1)*max)
+	{
+		release(&RTQ->lock);
+		return -1;
+	}
+	proc->rtperiod = period;
+	proc->rtruntime = runtime;
+	proc->rtdeadline = deadline;
+	proc->rtnext = ticks;
+	rtreplenish(proc);
+	release(&RTQ->lock);
+	return 0;
+}
+
+
+// Let process pid run only on the CPUs in mask, bit i
+// standing for cpus[i]. It moves at once if it is waiting
+// on the run queue of a CPU it may no longer use, or else
+// the next time it gives up the CPU. Returns 0, or -1 if
+// there is no such process or mask names no CPU.
+int
+setaffinity(int pid, uint mask)
+{
+	struct proc *p;
+
+	mask &= (1 << ncpu) - 1;
+	if (mask == 0)
+		return -1;
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		acquire(PLOCK(p));
+		if (p->pid == pid && p->state != UNUSED)
+		{
+			p->affinity = mask;
+			if (p->state == RUNNABLE && runqdel(p) == 0)
+				setrunnable(p);
+			release(PLOCK(p));
+			return 0;
+		}
+		release(PLOCK(p));
+	}
+	return -1;
+}
+
+
+// Return the affinity mask of process pid, or -1.
+int
+getaffinity(int pid)
+{
+	struct proc *p;
+	int mask;
+
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		acquire(PLOCK(p));
+		if (p->pid == pid && p->state != UNUSED)
+		{
+			mask = p->affinity;
+			release(PLOCK(p));
+			return mask;
+		}
+		release(PLOCK(p));
+	}
+	return -1;
+}
+
+
+// Set the nice value of process pid: the highest priority
+// level, counting from 0 at the top, that the MLFQ scheduler
+// gives it. Round robin ignores it. Returns the old value.
+int
+setpriority(int pid, int nice)
+{
+	struct proc *p;
+	int old;
+
+	if (nice < 0 || nice >= NMLFQ)
+		return -1;
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		acquire(PLOCK(p));
+		if (p->pid == pid && p->state != UNUSED)
+		{
+			// Takes effect when p next becomes RUNNABLE
+			old = p->nice;
+			p->nice = nice;
+			release(PLOCK(p));
+			return old;
+		}
+		release(PLOCK(p));
+	}
+	return -1;
 }
 
 
@@ -57,6 +625,25 @@ found:
 	p->state = EMBRYO;
 	// Give the process a unique pid
 	p->pid = nextpid++;
+	p->nzfault = 0;
+	p->nfilefault = 0;
+	p->ncowfault = 0;
+	p->nswapin = 0;
+	p->npromote = 0;
+	p->thread = 0;
+	p->ustack = 0;
+	p->ubuf = p->ubufend = 0;
+	p->fdt = 0;
+	p->argf = 0;
+	p->lastcpu = 0;
+	p->nice = proc ? proc->nice : 0;
+	p->priority = 0;
+	p->slice = 0;
+	p->tickets = proc ? proc->tickets : DEFTICKETS;
+	p->affinity = proc ? proc->affinity : (1 << ncpu) - 1;
+	p->rtperiod = 0;
+	p->stride = STRIDE1 / p->tickets;
+	p->pass = 0;
 
 	release(&ptable.lock);
 
@@ -104,7 +691,7 @@ userinit(void)
 	initproc = p;
 	// Create a page table for the first process, initially with
 	// mappings only for memory that the kernel uses.
-	if ((p->pgdir = setupkvm()) == 0)
+	if ((p->as = asalloc()) == 0 || (p->as->pgdir = setupkvm()) == 0)
 		panic("userinit: out of memory?");
 
 	// The inital contents of the first process' user-space memory are the
@@ -116,8 +703,8 @@ userinit(void)
 	// Copy that binary into the new process' memory by calling inituvm(),
 	// which allocates one page of physical memory, maps virtual address
 	// zero to that memory, and copies the binary to that page.
-	inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-	p->sz = PGSIZE;
+	inituvm(p->as->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+	p->as->sz = PGSIZE;
 
 	// Set up the trap frame with the inital user mode state
 	memset(p->tf, 0, sizeof(*p->tf));
@@ -149,7 +736,9 @@ userinit(void)
 	// Set p->name to initcode, mainly for debugging
 	safestrcpy(p->name, "initcode", sizeof(p->name));
 	// Set the process' current working directory
-	p->cwd = namei("/");
+	if ((p->fdt = fdtalloc()) == 0)
+		panic("userinit: out of fdtables");
+	p->fdt->cwd = namei("/");
 
 	// The following assignment to p->state (after acquire) lets
 	// other cores run this process. The acquire forces the above
@@ -157,36 +746,398 @@ userinit(void)
 	// the assignment might not be atomic.
 	// TODO: if this is the same situation as elsewhere, a real OS
 	//			would import and use an atomic C function.
-	acquire(&ptable.lock);
+	acquire(PLOCK(p));
 	// The process is now initialized, so we
 	// can now mark it available for scheduling.
-	p->state = RUNNABLE;
+	setrunnable(p);
 
+	release(PLOCK(p));
+}
+
+
+// Is part of [start, end) the buffer of a system call
+// that another thread sharing proc's address space is
+// in? The kernel may be using it while holding a spinlock,
+// when a page fault cannot be handled, so it must not be
+// unmapped. Caller must hold aslock(proc->as).
+int
+ubufbusy(uint start, uint end)
+{
+	struct proc *p;
+	int busy;
+
+	busy = 0;
+	acquire(&ptable.lock);
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+	{
+		if (p != proc && p->as == proc->as && p->state != UNUSED &&
+				p->ubuf < end && start < p->ubufend)
+			busy = 1;
+	}
 	release(&ptable.lock);
+	return busy;
 }
 
 
 // Grow current process's memory by n bytes.
+// Growing only reserves the address space; each new
+// page is allocated, zeroed, the first time it is
+// touched (see pagefault in vm.c). A request for more
+// than all of free memory fails up front, so that
+// malloc() still sees running out of memory.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
+	struct aspace *as;
 	uint sz;
 
-	sz = proc->sz;
+	as = proc->as;
+	aslock(as);
+	sz = as->sz;
 	if (n > 0)
 	{
-		if ((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0)
+		if (sz + n >= MMAPBASE || sz + n < sz ||
+				n / PGSIZE > kfreepages() + swapfreepages())
+		{
+			asunlock(as);
 			return -1;
+		}
+		sz += n;
+		proc->npromote += allocsuper(as->pgdir, as->sz, sz);
 	}
 	else if (n < 0)
 	{
-		if ((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0)
+		if (ubufbusy(sz + n, sz) ||
+				(sz = deallocuvm(as->pgdir, sz, sz + n)) == 0)
+		{
+			asunlock(as);
 			return  -1;
+		}
 	}
 
-	proc->sz = sz;
+	as->sz = sz;
 	switchuvm(proc);
+	if (n < 0)
+		tlbshootdown(as);
+	asunlock(as);
+	return 0;
+}
+
+
+// Allocate an empty address space with one reference,
+// or return 0 if there is none free.
+struct aspace*
+asalloc(void)
+{
+	struct aspace *as;
+
+	acquire(&ptable.lock);
+	for (as = ptable.as; as < &ptable.as[NPROC]; as++)
+	{
+		if (as->ref == 0)
+		{
+			memset(as, 0, sizeof(*as));
+			as->ref = 1;
+			release(&ptable.lock);
+			return as;
+		}
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+
+// Drop a reference to as. With the last one, write back
+// and free its mappings and its page table, which must not
+// be in use by this CPU (see exit). Sleeps.
+void
+asput(struct aspace *as)
+{
+	acquire(&ptable.lock);
+	if (as->ref > 1)
+	{
+		as->ref--;
+		release(&ptable.lock);
+		return;
+	}
+	release(&ptable.lock);
+
+	// No thread is left to take another reference.
+	freevmas(as->pgdir, as->vma);
+	shmrelease(as);
+	if (as->pgdir)
+		freevm(as->pgdir);
+
+	acquire(&ptable.lock);
+	as->ref = 0;
+	release(&ptable.lock);
+}
+
+
+// Allocate an empty table of open files with one
+// reference, or return 0 if there is none free.
+struct fdtable*
+fdtalloc(void)
+{
+	struct fdtable *fdt;
+
+	acquire(&ptable.lock);
+	for (fdt = ptable.fdt; fdt < &ptable.fdt[NPROC]; fdt++)
+	{
+		if (fdt->ref == 0)
+		{
+			memset(fdt->ofile, 0, sizeof(fdt->ofile));
+			fdt->cwd = 0;
+			fdt->ref = 1;
+			release(&ptable.lock);
+			return fdt;
+		}
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+
+// Drop a reference to fdt. With the last one, close its
+// files and release its current directory. Sleeps.
+void
+fdtput(struct fdtable *fdt)
+{
+	int fd;
+
+	acquire(&ptable.lock);
+	if (fdt->ref > 1)
+	{
+		fdt->ref--;
+		release(&ptable.lock);
+		return;
+	}
+	release(&ptable.lock);
+
+	// No thread is left to take another reference.
+	for (fd = 0; fd < NOFILE; fd++)
+	{
+		if (fdt->ofile[fd])
+		{
+			fileclose(fdt->ofile[fd]);
+			fdt->ofile[fd] = 0;
+		}
+	}
+	if (fdt->cwd)
+	{
+		begin_op();
+		iput(fdt->cwd);
+		end_op();
+		fdt->cwd = 0;
+	}
+
+	acquire(&ptable.lock);
+	fdt->ref = 0;
+	release(&ptable.lock);
+}
+
+
+// Keep other threads from changing the mappings of as,
+// or filling in its pages (see pagefault), until asunlock().
+// Sleeps.
+void
+aslock(struct aspace *as)
+{
+	acquire(&ptable.lock);
+	while (as->busy)
+		sleep(as, &ptable.lock);
+	as->busy = 1;
+	release(&ptable.lock);
+}
+
+
+void
+asunlock(struct aspace *as)
+{
+	acquire(&ptable.lock);
+	as->busy = 0;
+	wakeup(as);
+	release(&ptable.lock);
+}
+
+
+// Create a new process running the program at path with
+// arguments argv, as fork() followed by exec() in the child
+// would, but without copying the current process' memory
+// only to throw it away. ofile[] is the child's table of
+// open files; spawn() takes over its references, closing
+// them if it fails. Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct file **ofile)
+{
+	int i, pid;
+	struct proc *np;
+
+	if ((np = allocproc()) == 0)
+		goto bad;
+
+	// Start from the caller's registers, for the segment
+	// selectors and flags; execimage() sets eip and esp.
+	*np->tf = *proc->tf;
+	if ((np->fdt = fdtalloc()) == 0 || execimage(np, path, argv) < 0)
+	{
+		if (np->fdt)
+			fdtput(np->fdt);
+		np->fdt = 0;
+		kfree(np->kstack);
+		np->kstack = 0;
+		np->state = UNUSED;
+		goto bad;
+	}
+
+	np->parent = proc;
+	memmove(np->fdt->ofile, ofile, sizeof(np->fdt->ofile));
+	acquire(&proc->fdt->lock);
+	np->fdt->cwd = idup(proc->fdt->cwd);
+	release(&proc->fdt->lock);
+
+	pid = np->pid;
+
+	acquire(PLOCK(np));
+
+	setrunnable(np);
+
+	release(PLOCK(np));
+
+	return pid;
+
+bad:
+	for (i = 0; i < NOFILE; i++)
+		if (ofile[i])
+			fileclose(ofile[i]);
+	return -1;
+}
+
+
+// Take PLOCK() of p and of every other thread using its
+// address space, except the current process, in table
+// order, and note them in held[]. None of them can then
+// start running until swaprelease(). Returns how many.
+static int
+swaphold(struct proc *p, struct proc **held)
+{
+	struct aspace *as;
+	struct proc *q;
+	int n;
+
+	n = 0;
+	if ((as = p->as) == 0)
+		return 0;
+	for (q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+	{
+		if (q != proc && q->as == as)
+		{
+			acquire(PLOCK(q));
+			held[n++] = q;
+		}
+	}
+	return n;
+}
+
+
+static void
+swaprelease(struct proc **held, int n)
+{
+	while (--n >= 0)
+		release(PLOCK(held[n]));
+}
+
+
+// Can swapout() take pages from p? Not if p, or another
+// thread using its address space, is running on another
+// CPU, whose TLB would still map them, nor if one is in a
+// system call: the kernel may be using the memory while
+// holding a spinlock, when it cannot fault pages in (see
+// argptr). Nor while a thread holds aslock(). q->tf is the
+// trap frame of q's latest entry into the kernel from user
+// space. held[] is what swaphold(p) returned; a thread
+// that stops using the address space meanwhile can only
+// have been running, so p or another held thread was too.
+static int
+swappable(struct proc *p, struct proc **held, int n)
+{
+	struct proc *q;
+	int i;
+
+	if (p != proc && (n == 0 || p->as != held[0]->as))
+		return 0;
+	for (i = 0; i < n; i++)
+	{
+		q = held[i];
+		if (q->state != RUNNABLE && q->state != SLEEPING)
+			return 0;
+		if (q->tf->trapno == T_SYSCALL)
+			return 0;
+	}
+	if (p->as == 0 || p->as->pgdir == 0 || p->as->busy)
+		return 0;
+	if (proc->as == p->as && proc->tf->trapno == T_SYSCALL)
+		return 0;
+	return 1;
+}
+
+
+// Free a page of memory by writing a user page out to swap.
+// The clock hand sweeps each process' pages in turn (see
+// clockscan); going twice round all processes is enough
+// to find a page unless none can be swapped.
+// Sleeps. Returns 0, or -1 if no page could be freed.
+int
+swapout(void)
+{
+	static struct proc *hand = ptable.proc;
+	static uint handva;
+	struct proc *p, *held[NPROC];
+	pte_t *pte;
+	uint pa;
+	int n, nheld, slot;
+
+	// Take a slot first: sleep() and wakeup() acquire
+	// process locks with swap.lock held, so swap.c must
+	// not be entered with one held.
+	if ((slot = swapalloc()) < 0)
+		return -1;
+
+	pte = 0;
+	for (n = 0; n <= 2*NPROC; n++)
+	{
+		p = hand;
+		nheld = swaphold(p, held);
+		if (swappable(p, held, nheld))
+		{
+			pte = clockscan(p->as->pgdir, &handva, p->as->sz);
+			if (p->as == proc->as)
+				lcr3(V2P(p->as->pgdir));	// PTE_A bits changed
+			if (pte)
+				break;
+		}
+		swaprelease(held, nheld);
+		if (++hand == &ptable.proc[NPROC])
+			hand = ptable.proc;
+		handva = 0;
+	}
+	if (pte == 0)
+	{
+		swapcancel(slot);
+		return -1;
+	}
+
+	// Take the page away from p before letting p run again.
+	pa = PTE_ADDR(*pte);
+	*pte = (slot << PTXSHIFT) | (PTE_FLAGS(*pte) & ~(PTE_P|PTE_A|PTE_D)) | PTE_SWAP;
+	if (p->as == proc->as)
+		invlpg((void*)handva);
+	handva += PGSIZE;
+	swaprelease(held, nheld);
+
+	swapwrite(slot, P2V(pa));
+	kfree(P2V(pa));
 	return 0;
 }
 
@@ -197,7 +1148,7 @@ growproc(int n)
 int
 fork(void)
 {
-	int i, pid;
+	int i, pid, eager;
 	struct proc *np;
 
 	// Allocate process
@@ -206,38 +1157,146 @@ fork(void)
 		return -1;
 	}
 
-	// Copy process state from p
-	if ((np->pgdir = copyuvm(proc->pgdir, proc->sz)) == 0)
+	// Copy process state from p. The other threads sharing
+	// proc's address space must not change it meanwhile,
+	// and their pages are copied now rather than made
+	// copy-on-write under their feet (see argbuf).
+	if ((np->as = asalloc()) == 0)
+		goto bad;
+	aslock(proc->as);
+	eager = proc->as->ref > 1;
+	if ((np->as->pgdir = copyuvm(proc->as->pgdir, proc->as->sz, eager)) == 0)
 	{
-		kfree(np->kstack);
-		np->kstack = 0;
-		np->state = UNUSED;
-		return -1;
+		asunlock(proc->as);
+		goto bad;
 	}
 
-	np->sz = proc->sz;
+	// mmap() regions lie above sz; copy them too.
+	for (i = 0; i < NVMA; i++)
+	{
+		if (proc->as->vma[i].ip && proc->as->vma[i].start >= MMAPBASE &&
+				copyvma(np->as->pgdir, proc->as->pgdir, &proc->as->vma[i], eager) < 0)
+			break;
+	}
+
+	// copyuvm() made the parent's pages read-only
+	switchuvm(proc);
+	tlbshootdown(proc->as);
+
+	if (i < NVMA || shmfork(np) < 0)
+	{
+		asunlock(proc->as);
+		goto bad;
+	}
+
+	np->as->sz = proc->as->sz;
+	for (i = 0; i < NVMA; i++)
+	{
+		if (proc->as->vma[i].ip)
+		{
+			np->as->vma[i] = proc->as->vma[i];
+			idup(np->as->vma[i].ip);
+		}
+	}
+	asunlock(proc->as);
+
 	np->parent = proc;
 	*np->tf = *proc->tf;
 
 	// Clear %eax so that fork returns 0 in the child
 	np->tf->eax = 0;
 
+	if ((np->fdt = fdtalloc()) == 0)
+		goto bad;
+	acquire(&proc->fdt->lock);
 	for (i = 0; i < NOFILE; i++)
 	{
-		if (proc->ofile[i])
-			np->ofile[i] = filedup(proc->ofile[i]);
+		if (proc->fdt->ofile[i])
+			np->fdt->ofile[i] = filedup(proc->fdt->ofile[i]);
 	}
-	np->cwd = idup(proc->cwd);
+	np->fdt->cwd = idup(proc->fdt->cwd);
+	release(&proc->fdt->lock);
 
 	safestrcpy(np->name, proc->name, sizeof(proc->name));
 
 	pid = np->pid;
 
-	acquire(&ptable.lock);
+	acquire(PLOCK(np));
+
+	setrunnable(np);
+
+	release(PLOCK(np));
+
+	return pid;
+
+bad:
+	if (np->as)
+		asput(np->as);
+	np->as = 0;
+	if (np->fdt)
+		fdtput(np->fdt);
+	np->fdt = 0;
+	kfree(np->kstack);
+	np->kstack = 0;
+	np->state = UNUSED;
+	return -1;
+}
+
+
+// Create a thread that shares the current process's
+// address space and starts at fcn(arg1, arg2) on the
+// stack page at ustack, which the caller allocated.
+// It shares the open file descriptors and the current
+// directory too.
+// Returns the new thread's pid, or -1.
+int
+clone(uint fcn, uint arg1, uint arg2, uint ustack)
+{
+	int i, pid;
+	struct proc *np;
+	uint sp, ustackargs[3];
+
+	if (ustack % sizeof(uint) || ustack + PGSIZE < ustack ||
+			ustack + PGSIZE > proc->as->sz)
+		return -1;
+
+	// Fake return PC, then the arguments, as a call would
+	sp = ustack + PGSIZE - sizeof(ustackargs);
+	ustackargs[0] = 0xffffffff;
+	ustackargs[1] = arg1;
+	ustackargs[2] = arg2;
+	if (prefault(sp, sizeof(ustackargs), 1) < 0)
+		return -1;
+	aslock(proc->as);
+	i = copyout(proc->as->pgdir, sp, ustackargs, sizeof(ustackargs));
+	switchuvm(proc);
+	tlbshootdown(proc->as);
+	asunlock(proc->as);
+	if (i < 0)
+		return -1;
 
-	np->state = RUNNABLE;
+	if ((np = allocproc()) == 0)
+		return -1;
 
+	acquire(&ptable.lock);
+	proc->as->ref++;
+	proc->fdt->ref++;
 	release(&ptable.lock);
+	np->as = proc->as;
+	np->fdt = proc->fdt;
+	np->thread = 1;
+	np->ustack = ustack;
+	np->parent = proc;
+	*np->tf = *proc->tf;
+	np->tf->eip = fcn;
+	np->tf->esp = sp;
+	safestrcpy(np->name, proc->name, sizeof(proc->name));
+
+	pid = np->pid;
+
+	acquire(PLOCK(np));
+	setrunnable(np);
+	release(PLOCK(np));
 
 	return pid;
 }
@@ -249,32 +1308,29 @@ fork(void)
 void
 exit(void)
 {
+	struct aspace *as;
 	struct proc *p;
-	int fd;
 
 	if (proc == initproc)
 //		panic("init exiting");
 		panic("in exit(): proc == initproc");
 
-	// Close all open files
-	for (fd = 0; fd < NOFILE; fd++)
-	{
-		if (proc->ofile[fd])
-		{
-			fileclose(proc->ofile[fd]);
-			proc->ofile[fd] = 0;
-		}
-	}
+	// Close all open files, unless other threads
+	// still use them.
+	fdtput(proc->fdt);
+	proc->fdt = 0;
 
-	begin_op();
-	iput(proc->cwd);
-	end_op();
-	proc->cwd = 0;
+	// Give up the address space, freeing it if no
+	// other thread uses it, from the kernel page table.
+	as = proc->as;
+	proc->as = 0;
+	switchuvm(proc);
+	asput(as);
 
 	acquire(&ptable.lock);
 
 	// Parent might be sleeping in wait()
-	wakeup1(proc->parent);
+	wakeup(proc->parent);
 
 	// Pass abandoned children to init
 	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
@@ -282,22 +1338,46 @@ exit(void)
 		if (p->parent == proc)
 		{
 			p->parent = initproc;
+			p->thread = 0;
 			if (p->state == ZOMBIE)
-				wakeup1(initproc);
+				wakeup(initproc);
 		}
 	}
 
-	// Jump into the scheduler, never to return.
+	// Jump into the scheduler, never to return. The parent
+	// sees ZOMBIE only once ptable.lock is released, and
+	// frees the kernel stack only once PLOCK(proc) is, after
+	// the switch away from it.
+	acquire(PLOCK(proc));
 	proc->state = ZOMBIE;
+	release(&ptable.lock);
 	sched();
 	panic("zombie exit");
 }
 
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(void)
+// Free what is left of zombie p, for wait() and join().
+// Caller must hold ptable.lock and PLOCK(p).
+static void
+freeproc(struct proc *p)
+{
+	kfree(p->kstack);
+	p->kstack = 0;
+	p->pid = 0;
+	p->parent = 0;
+	p->name[0] = 0;
+	p->killed = 0;
+	p->thread = 0;
+	p->state = UNUSED;
+}
+
+
+// Wait for a child process, or if thread is set, a child
+// thread made by clone(), to exit. Return its pid and set
+// *ustack to the thread's stack. Return -1 if there are
+// no such children.
+static int
+reap(int thread, uint *ustack)
 {
 	struct proc *p;
 	int havekids, pid;
@@ -309,21 +1389,19 @@ wait(void)
 		havekids = 0;
 		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
 		{
-			if (p->parent != proc)
+			if (p->parent != proc || p->thread != thread)
 				continue;
 			havekids = 1;
 			if (p->state == ZOMBIE)
 			{
-				// Found one
+				// Found one. Wait for its CPU to switch
+				// away from it before freeing its stack.
+				acquire(PLOCK(p));
 				pid = p->pid;
-				kfree(p->kstack);
-				p->kstack = 0;
-				freevm(p->pgdir);
-				p->pid = 0;
-				p->parent = 0;
-				p->name[0] = 0;
-				p->killed = 0;
-				p->state = UNUSED;
+				if (ustack)
+					*ustack = p->ustack;
+				freeproc(p);
+				release(PLOCK(p));
 				release(&ptable.lock);
 				return pid;
 			}
@@ -337,12 +1415,31 @@ wait(void)
 		}
 
 		// Wait for children to exit
-		//	(see wakeup1 call in proc_exit)
+		//	(see wakeup call in exit)
 		sleep(proc, &ptable.lock);
 	}
 }
 
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(void)
+{
+	return reap(0, 0);
+}
+
+
+// Wait for a thread made by clone() to exit and return
+// its pid, with its stack in *ustack, so that the caller
+// can free it. Return -1 if this process has no threads.
+int
+join(uint *ustack)
+{
+	return reap(1, ustack);
+}
+
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns. It loops, doing:
@@ -355,31 +1452,39 @@ scheduler(void)
 {
 	// Per-CPU variable
 	struct proc *p;
+	struct runq *rq, *victim;
 
 	for ( ; ; )
 	{
 		// Enable interrupts on this processor
 		sti();
 
-		// Loop over process table looking for process to run;
-		// one with p->state set to RUNNABLE. Initially there
-		// is only one: initproc.
-		// TODO:	although I have not seen anything about it,
-		//			I would imagine that this should be more along
-		//			the lines of an explicit free list. Something
-		//			O(1), not O(n). At least it should be after
-		//			the initial run.
-		acquire(&ptable.lock);
-		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+		// Take the real-time process with the earliest deadline,
+		// or else the process that has waited longest to run on
+		// this CPU, or else steal one from the busiest other
+		// CPU. Initially there is only one: initproc.
+		// An idle CPU only looks at the queue lengths, so as
+		// not to contend for their locks with busy ones.
+		p = 0;
+		rq = MYRUNQ();
+		victim = rq->n > 0 ? 0 : busiest();
+		if (RTQ->n > 0 || rq->n > 0 || victim)
 		{
-			if (p->state != RUNNABLE)
-				continue;
-
-			// FOR DEBUGGING:
-			cprintf("scheduler found a process to run\n");
+			if ((p = runqget(RTQ)) == 0 && (p = runqget(rq)) == 0 &&
+					victim && (p = runqget(victim)) != 0)
+				cpu->nsteal++;
+		}
+		if (p != 0)
+		{
+			// Wait for the CPU that last ran p, if it has
+			// only just put p on a run queue, to switch away.
+			acquire(PLOCK(p));
+			if (p->lastcpu && p->lastcpu != cpu)
+				cpu->nmigrate++;
+			p->lastcpu = cpu;
 
 			// Switch to chosen process. It is the process's job
-			// to release ptable.lock and then reacquire it
+			// to release PLOCK(p) and then reacquire it
 			// before jumping back to us.
 
 			// Set proc to the process found
@@ -415,13 +1520,18 @@ scheduler(void)
 			// Process is done running for now.
 			// It should have changed its p->state before coming back.
 			proc = 0;
+			release(PLOCK(p));
 		}
-		release(&ptable.lock);
+
+		// Nothing to run: use the idle time to
+		// refill the pool of zeroed pages.
+		if (p == 0)
+			kzeroidle();
 	}
 }
 
 
-// Enter scheduler. Must hold only ptable.lock and have
+// Enter scheduler. Must hold only PLOCK(proc) and have
 // changed proc->state. Saves and restores intena because
 // intena is a property of this kernel thread, not this CPU.
 // It should be proc->intena and proc->ncli, but that would
@@ -432,8 +1542,8 @@ sched(void)
 {
 	int intena;
 
-	if (!holding(&ptable.lock))
-		panic("sched ptable.lock");
+	if (!holding(PLOCK(proc)))
+		panic("sched proc lock");
 	if (cpu->ncli != 1)
 		panic("sched locks");
 	if (proc->state == RUNNING)
@@ -450,10 +1560,10 @@ sched(void)
 void
 yield(void)
 {
-	acquire(&ptable.lock);
-	proc->state = RUNNABLE;
+	acquire(PLOCK(proc));
+	setrunnable(proc);
 	sched();
-	release(&ptable.lock);
+	release(PLOCK(proc));
 }
 
 
@@ -463,8 +1573,8 @@ void
 forkret(void)
 {
 	static int first = 1;
-	// Still holding ptable.lock from scheduler
-	release(&ptable.lock);
+	// Still holding PLOCK(proc) from scheduler
+	release(PLOCK(proc));
 
 	if (first)
 	{
@@ -475,6 +1585,7 @@ forkret(void)
 		first = 0;
 		iinit(ROOTDEV);
 		initlog(ROOTDEV);
+		swapinit(ROOTDEV);
 	}
 
 	// Return to "caller", actually trapret()
@@ -514,63 +1625,75 @@ forkret(void)
 void
 sleep(void *chan, struct spinlock *lk)
 {
+	struct chanq *q;
+
 	if (proc == 0)
 		panic("sleep");
 
 	if (lk == 0)
 		panic("sleep without lk");
 
-	// Must acquire ptable.lock in order to
-	// change p->state and then call sched().
-	// Once we hold ptable.lock, we can be
-	// guaranteed that we won't miss any wakeup
-	// (wakeup runs with ptable.lock locked),
-	// so it is ok to release lk.
-	if (lk != &ptable.lock)
-	{
-		acquire(&ptable.lock);
-		release(lk);
-	}
-
-	// Go to sleep
+	// Must acquire PLOCK(proc) in order to
+	// change proc->state and then call sched().
+	// Once we are SLEEPING on the hash chain for
+	// chan, we can be guaranteed that we won't
+	// miss any wakeup (wakeup looks at the chain
+	// with its lock held, unless it is empty), so
+	// it is ok to release lk. A wakeup that comes
+	// before sched() has switched away waits for
+	// PLOCK(proc) before making us RUNNABLE.
+	q = CHANHASH(chan);
+	acquire(&q->lock);
+	acquire(PLOCK(proc));
 	proc->chan = chan;
 	proc->state = SLEEPING;
+	proc->cnext = q->head;
+	q->head = proc;
+	release(&q->lock);
+	release(lk);
+
+	// Go to sleep
 	sched();
 
 	// Tidy up
 	proc->chan = 0;
 
 	// Reacquire original lock
-	if (lk != &ptable.lock)
-	{
-		release(&ptable.lock);
-		acquire(lk);
-	}
-}
-
-
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void
-wakeup1(void *chan)
-{
-	struct proc *p;
-
-	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-	{
-		if (p->state == SLEEPING && p->chan == chan)
-			p->state = RUNNABLE;
-	}
+	release(PLOCK(proc));
+	acquire(lk);
 }
 
 
 // Wake up all processes sleeping on chan.
+// Most calls find no one sleeping, and those need not
+// take any lock: a process going to sleep gets on the
+// hash chain before it releases the lock guarding what
+// it waits for, which the caller has changed.
 void
 wakeup(void *chan)
 {
-	acquire(&ptable.lock);
-	wakeup1(chan);
-	release(&ptable.lock);
+	struct chanq *q;
+	struct proc *p, **pp;
+
+	q = CHANHASH(chan);
+	if (*(struct proc * volatile *)&q->head == 0)
+		return;
+	acquire(&q->lock);
+	pp = &q->head;
+	while ((p = *pp) != 0)
+	{
+		if (p->chan == chan)
+		{
+			*pp = p->cnext;
+			p->cnext = 0;
+			acquire(PLOCK(p));
+			setrunnable(p);
+			release(PLOCK(p));
+		}
+		else
+			pp = &p->cnext;
+	}
+	release(&q->lock);
 }
 
 
@@ -586,22 +1709,42 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-	struct proc *p;
+	struct proc *p, **pp;
+	struct chanq *q;
+	void *chan;
 
-	acquire(&ptable.lock);
 	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
 	{
+		acquire(PLOCK(p));
 		if (p->pid == pid)
 		{
 			p->killed = 1;
-			// Wake process from sleep, if necessary
-			if (p->state == SLEEPING)
-				p->state = RUNNABLE;
-			release(&ptable.lock);
+			chan = p->state == SLEEPING ? p->chan : 0;
+			release(PLOCK(p));
+
+			// Wake process from sleep, if necessary. The
+			// chain's lock comes first, so look again: p
+			// may have been woken meanwhile.
+			if (chan)
+			{
+				q = CHANHASH(chan);
+				acquire(&q->lock);
+				for (pp = &q->head; *pp && *pp != p; pp = &(*pp)->cnext)
+					;
+				if (*pp)
+				{
+					*pp = p->cnext;
+					p->cnext = 0;
+					acquire(PLOCK(p));
+					setrunnable(p);
+					release(PLOCK(p));
+				}
+				release(&q->lock);
+			}
 			return 0;
 		}
+		release(PLOCK(p));
 	}
-	release(&ptable.lock);
 	return -1;
 }
 
@@ -634,7 +1777,9 @@ procdump(void)
 			state = states[p->state];
 		else
 			state = "???";
-		cprintf("%d %s %s", p->pid, state, p->name);
+		cprintf("%d %s %s faults %d/%d/%d/%d super %d prio %d/%d tickets %d cpus %x",
+				p->pid, state, p->name, p->nzfault, p->nfilefault, p->ncowfault,
+				p->nswapin, p->npromote, p->priority, p->nice, p->tickets, p->affinity);
 		if (p->state == SLEEPING)
 		{
 			getcallerpcs((uint*)p->context->ebp+2, pc);
@@ -643,4 +1788,7 @@ procdump(void)
 		}
 		cprintf("\n");
 	}
+	for (i = 0; i < ncpu; i++)
+		cprintf("cpu %d: runq %d, stole %d, migrated in %d\n",
+				i, ptable.runq[i].n, cpus[i].nsteal, cpus[i].nmigrate);
 }
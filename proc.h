@@ -11,6 +11,10 @@ struct cpu {
 	// CPU-local storage variables; see below
 	struct cpu *cpu;
 	struct proc *proc;				// The currently running process
+
+	volatile uint ntlbflush;		// TLB flushes asked for by other CPUs
+	uint nsteal;					// Processes taken from other CPUs' run queues
+	uint nmigrate;					// Processes run here that last ran elsewhere
 };
 
 extern struct cpu cpus[NCPU];
@@ -53,21 +57,73 @@ struct context {
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 
-// Per-process state
-struct proc {
+// A region of user memory whose pages are read in from
+// a file the first time they are touched (see pagefault
+// in vm.c), e.g. the segments of the running program.
+struct vma {
+	uint start;						// First address, page aligned
+	uint end;						// One past the last address
+	struct inode *ip;				// File to read from; 0 if slot unused
+	uint off;						// File offset of start
+	uint filesz;					// Bytes from the file; the rest is zero
+	int flags;						// VMA_WRITE, VMA_SHARED
+};
+
+#define VMA_WRITE	0x1		// user may write the region
+#define VMA_SHARED	0x2		// writes go to the file (mmap MAP_SHARED)
+
+
+// A user address space. The threads of a process made by
+// clone() all use the same one, which lives until the last
+// of them exits or execs.
+struct aspace {
+	int ref;						// Threads using it; 0 if free (ptable.lock)
+	int busy;						// Held by aslock() (ptable.lock)
 	uint sz;						// Size of process memory (bytes)
 	pde_t* pgdir;					// Page table
+	struct vma vma[NVMA];			// File-backed memory regions
+	struct shmseg *shm[NSHMPROC];	// Attached shared memory segments
+};
+
+
+// Per-process state
+struct proc {
+	struct aspace *as;				// User memory; 0 once exiting
 	char *kstack;					// Bottom of kernel stack for this process
-	enum procstate state;			// Process state
+	enum procstate state;			// Process state (PLOCK in proc.c)
+	struct proc *rnext;				// Next on run queue, if RUNNABLE
+	struct cpu *lastcpu;			// CPU it last ran on, or 0
+	int nice;						// Highest MLFQ level allowed (see setpriority)
+	int priority;					// MLFQ level, 0 highest
+	int slice;						// Ticks used at this level
+	int tickets;					// Share of the CPUs (stride scheduler)
+	uint stride;					// STRIDE1 / tickets
+	uint pass;						// Advances by stride per tick run
+	uint affinity;					// CPUs it may run on, bit i for cpus[i]
+	int rtperiod;					// Real-time period in ticks, or 0 if not
+	int rtruntime;					// Ticks of CPU it needs each period
+	int rtdeadline;					// Due this many ticks into each period
+	uint rtnext;					// ticks when the next period starts
+	uint rtdue;						// ticks when this period's work is due
+	int rtbudget;					// Ticks left to run this period
 	int pid;						// Process ID
 	struct proc *parent;			// Parent process
 	struct trapframe *tf;			// Trap frame for current syscall
+	uint ubuf, ubufend;				// User buffer of current syscall (see argbuf)
 	struct context *context;		// swtch() here to run process
 	void *chan;						// If non-zero, sleeping on chan
+	struct proc *cnext;				// Next sleeping on the same hash of chan
 	int killed;						// If non-zero, have been killed
-	struct file *ofile[NOFILE];		// Open files
-	struct inode *cwd;				// Current working directory
+	struct fdtable *fdt;			// Open files and current directory
+	struct file *argf;				// Held by argfd() until syscall returns
+	int thread;						// Made by clone(); reaped by join()
+	uint ustack;					// User stack passed to clone()
 	char name[16];					// Process name (debugging)
+	uint nzfault;					// Demand-zero page faults
+	uint nfilefault;				// Page faults read from a file
+	uint ncowfault;					// Copy-on-write page faults
+	uint nswapin;					// Pages read back from swap
+	uint npromote;					// Heap regions made superpages
 };
 
 
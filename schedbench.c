@@ -0,0 +1,96 @@
+// Measure context switch time with many processes around.
+//
+// A parent and child pass a byte back and forth through a
+// pair of pipes, so that each round trip takes at least two
+// context switches, while a number of other processes sit
+// blocked in read(). A scheduler that scans the whole process
+// table slows down as the table fills; one with a run queue
+// should not.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NROUND	2000
+
+// Start n processes that block reading the pipe fds until
+// its write end is closed. Returns how many were started.
+int
+idlers(int n, int *fds)
+{
+  int i, pid;
+  char c;
+
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0)
+      break;
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit();
+    }
+  }
+  return i;
+}
+
+// Time NROUND round trips between this process and a child.
+int
+pingpong(void)
+{
+  int i, pid, start, p1[2], p2[2];
+  char c;
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf(1, "schedbench: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "schedbench: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < NROUND; i++){
+      read(p1[0], &c, 1);
+      write(p2[1], &c, 1);
+    }
+    exit();
+  }
+
+  start = uptime();
+  c = 'x';
+  for(i = 0; i < NROUND; i++){
+    write(p1[1], &c, 1);
+    read(p2[0], &c, 1);
+  }
+  wait();
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[0]);
+  close(p2[1]);
+  return uptime() - start;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static int counts[] = { 0, 8, 16, 32, 56 };
+  int i, n, t, fds[2];
+
+  for(i = 0; i < sizeof(counts)/sizeof(counts[0]); i++){
+    if(pipe(fds) < 0){
+      printf(1, "schedbench: pipe failed\n");
+      exit();
+    }
+    n = idlers(counts[i], fds);
+    t = pingpong();
+    printf(1, "%d blocked processes: %d round trips in %d ticks\n",
+           n, NROUND, t);
+    close(fds[0]);
+    close(fds[1]);
+    while(n-- > 0)
+      wait();
+  }
+  exit();
+}
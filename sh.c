@@ -3,6 +3,7 @@
 #include "types.h"
 #include "user.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Parsed command representation
 #define EXEC	1
@@ -50,8 +51,10 @@ struct backcmd {
 };
 
 int fork1(void);		// Fork, but panics on failure
+int spawncmd(struct cmd*);
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 
 // Execute cmd. Never returns.
 void
@@ -152,7 +155,8 @@ int
 main(void)
 {
 	static char buf[100];
-	int fd;
+	struct cmd *cmd;
+	int fd, pid;
 
 	// Ensure that three file descriptors are open
 	while ((fd = open("console", O_RDWR)) >= 0)
@@ -175,9 +179,15 @@ main(void)
 				printf(2, "cannot cd %s\n", buf+3);
 			continue;
 		}
-		if (fork1() == 0)
-			runcmd(parsecmd(buf));
-		wait();
+		// Parsing happens here, in the long-lived shell,
+		// so a syntax error must not exit
+		if ((cmd = parsecmd(buf)) == 0)
+			continue;
+		if ((pid = spawncmd(cmd)) < 0 && fork1() == 0)
+			runcmd(cmd);
+		if (pid != 0)
+			wait();
+		freecmd(cmd);
 	}
 	exit();
 }
@@ -191,6 +201,49 @@ panic(char *s)
 }
 
 
+// Start a simple command, with any redirections, using
+// spawn(), which need not copy the shell as fork() does.
+// Returns the child's pid, 0 if nothing was started (an
+// empty command, or spawn() failed, which is reported
+// here), or -1 if spawn() cannot express cmd (pipes,
+// lists, background commands, blocks); the caller then
+// runs it with fork() and runcmd().
+int
+spawncmd(struct cmd *cmd)
+{
+	struct spawnfd fa[MAXARGS];
+	struct execcmd *ecmd;
+	struct redircmd *rcmd;
+	int n, pid;
+
+	// The outermost redirection is the one runcmd() does first
+	for (n = 0; cmd && cmd->type == REDIR; n++)
+	{
+		if (n == MAXARGS)
+			return -1;
+		rcmd = (struct redircmd*)cmd;
+		fa[n].op = SPAWN_OPEN;
+		fa[n].fd = rcmd->fd;
+		fa[n].src = 0;
+		fa[n].mode = rcmd->mode;
+		fa[n].path = rcmd->file;
+		cmd = rcmd->cmd;
+	}
+	if (cmd == 0 || cmd->type != EXEC)
+		return -1;
+	ecmd = (struct execcmd*)cmd;
+	// Redirections alone still open (create) their files
+	if (ecmd->argv[0] == 0)
+		return n > 0 ? -1 : 0;
+	if ((pid = spawn(ecmd->argv[0], ecmd->argv, fa, n)) < 0)
+	{
+		printf(2, "exec %s failed\n", ecmd->argv[0]);
+		return 0;
+	}
+	return pid;
+}
+
+
 int
 fork1(void)
 {
@@ -347,20 +400,42 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+static char *parseerr;		// First syntax error in the line, or 0
+
 
+// Note a syntax error and skip the rest of the line,
+// which ends every loop in the parser.
+void
+syntax(char **ps, char *es, char *msg)
+{
+	if (parseerr == 0)
+		parseerr = msg;
+	*ps = es;
+}
+
+
+// Parse the command line s. On a syntax error, print it
+// and return 0.
 struct cmd*
 parsecmd(char *s)
 {
 	char *es;
 	struct cmd *cmd;
 
+	parseerr = 0;
 	es = s + strlen(s);
 	cmd = parseline(&s, es);
 	peek(&s, es, "");
 	if (s != es)
 	{
 		printf(2, "leftovers: %s\n", s);
-		panic("syntax");
+		syntax(&s, es, "syntax");
+	}
+	if (parseerr)
+	{
+		printf(2, "%s\n", parseerr);
+		freecmd(cmd);
+		return 0;
 	}
 	nulterminate(cmd);
 	return cmd;
@@ -412,7 +487,10 @@ parsedirs(struct cmd *cmd, char **ps, char *es)
 	{
 		tok = gettoken(ps, es, 0, 0);
 		if (gettoken(ps, es, &q, &eq) != 'a')
-			panic("missing file for redirection");
+		{
+			syntax(ps, es, "missing file for redirection");
+			break;
+		}
 		switch(tok)
 		{
 			case '<':
@@ -440,7 +518,10 @@ parseblock(char **ps, char *es)
 	gettoken(ps, es, 0, 0);
 	cmd = parseline(ps, es);
 	if (!peek(ps, es, ")"))
-		panic("syntax - missing )");
+	{
+		syntax(ps, es, "syntax - missing )");
+		return cmd;
+	}
 	gettoken(ps, es, 0, 0);
 	cmd = parsedirs(cmd, ps, es);
 	return cmd;
@@ -468,12 +549,18 @@ parseexec(char **ps, char *es)
 		if ((tok = gettoken(ps, es, &q, &eq)) == 0)
 			break;
 		if (tok != 'a')
-			panic("syntax");
+		{
+			syntax(ps, es, "syntax");
+			break;
+		}
+		if (argc == MAXARGS - 1)
+		{
+			syntax(ps, es, "too many args");
+			break;
+		}
 		cmd->argv[argc] = q;
 		cmd->eargv[argc] = eq;
 		argc++;
-		if(argc >= MAXARGS)
-			panic("too many args");
 		ret = parsedirs(ret, ps, es);
 	}
 	cmd->argv[argc] = 0;
@@ -529,3 +616,43 @@ nulterminate(struct cmd *cmd)
 	}
 	return cmd;
 }
+
+
+// Free the tree that parsecmd() built
+void
+freecmd(struct cmd *cmd)
+{
+	struct backcmd *bcmd;
+	struct listcmd *lcmd;
+	struct pipecmd *pcmd;
+	struct redircmd *rcmd;
+
+	if (cmd == 0)
+		return;
+
+	switch(cmd->type)
+	{
+		case REDIR:
+			rcmd = (struct redircmd*)cmd;
+			freecmd(rcmd->cmd);
+			break;
+
+		case PIPE:
+			pcmd = (struct pipecmd*)cmd;
+			freecmd(pcmd->left);
+			freecmd(pcmd->right);
+			break;
+
+		case LIST:
+			lcmd = (struct listcmd*)cmd;
+			freecmd(lcmd->left);
+			freecmd(lcmd->right);
+			break;
+
+		case BACK:
+			bcmd = (struct backcmd*)cmd;
+			freecmd(bcmd->cmd);
+			break;
+	}
+	free(cmd);
+}
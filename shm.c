@@ -0,0 +1,305 @@
+// Shared memory segments.
+//
+// A segment is a set of physical pages that several
+// processes map at once, so that they can exchange data
+// without copying it through a pipe.
+//
+// Interface (system calls in sysproc.c):
+// * shmget(key, size) returns the id of the segment with
+//		that key, creating it with size zeroed bytes if
+//		there is none.
+// * shmat(id) maps the segment into the calling process
+//		and returns its address. Each process has NSHMPROC
+//		attach slots; slot i is always at SHMADDR(i).
+// * shmdt(addr) unmaps the segment attached at addr.
+// * shmrm(id) removes the segment: shmget no longer finds
+//		its key, and it is destroyed once nothing is
+//		attached to it.
+//
+// A forked child inherits its parent's attachments, and
+// threads made by clone() share them; exec and exit
+// detach everything once no thread uses the address
+// space. Detaching never destroys a segment that has not
+// been removed, so it outlives its users until shmrm,
+// like a file outlives the processes that open it.
+//
+// The segment holds one kalloc() reference on each of its
+// pages and every page table mapping it holds another
+// (see mapshared), so a page is not freed until both the
+// segment is gone and freevm() has run on every process
+// that mapped it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+// Address of attach slot i
+#define SHMADDR(i)	(SHMBASE + (i)*SHMPAGES*PGSIZE)
+
+struct shmseg {
+	int key;
+	int npages;			// 0 if this entry is free
+	int ref;			// attachments, plus one until removed
+	int removed;		// shmrm() called
+	int gen;			// times this entry was reused (see SHMID)
+	char *pages[SHMPAGES];
+};
+
+// A segment's id names its entry and generation, so the
+// id of a destroyed segment does not reach a new one that
+// reuses the entry.
+#define SHMID(s)	((s)->gen*NSHM + ((s) - shmtable.seg))
+#define SHMGENS		(0x7FFFFFFF / NSHM)
+
+struct {
+	struct spinlock lock;
+	struct shmseg seg[NSHM];
+} shmtable;
+
+
+void
+shminit(void)
+{
+	initlock(&shmtable.lock, "shmtable");
+}
+
+
+// Return the id of the segment with key, or
+// create one of size bytes. Returns -1 if an existing
+// segment is smaller than size, or there is no room.
+int
+shmget(int key, uint size)
+{
+	struct shmseg *s;
+	int i, n;
+
+	if (size == 0 || size > SHMPAGES*PGSIZE)
+		return -1;
+	n = PGROUNDUP(size) / PGSIZE;
+
+	acquire(&shmtable.lock);
+	for (s = shmtable.seg; s < &shmtable.seg[NSHM]; s++)
+	{
+		if (s->npages && !s->removed && s->key == key)
+		{
+			i = s->npages < n ? -1 : SHMID(s);
+			release(&shmtable.lock);
+			return i;
+		}
+	}
+
+	for (s = shmtable.seg; s < &shmtable.seg[NSHM]; s++)
+		if (s->npages == 0)
+			break;
+	if (s == &shmtable.seg[NSHM])
+	{
+		release(&shmtable.lock);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+	{
+		if ((s->pages[i] = kalloc_zeroed()) == 0)
+		{
+			while (--i >= 0)
+				kfree(s->pages[i]);
+			release(&shmtable.lock);
+			return -1;
+		}
+	}
+	s->key = key;
+	s->npages = n;
+	s->ref = 1;
+	s->removed = 0;
+	s->gen = (s->gen + 1) % SHMGENS;
+	release(&shmtable.lock);
+	return SHMID(s);
+}
+
+
+// Find the live segment with id. Caller holds shmtable.lock.
+static struct shmseg*
+shmfind(int id)
+{
+	struct shmseg *s;
+
+	if (id < 0)
+		return 0;
+	s = &shmtable.seg[id % NSHM];
+	if (s->npages == 0 || s->removed || SHMID(s) != id)
+		return 0;
+	return s;
+}
+
+
+// Drop one reference to s, destroying it with the last.
+// Pages still mapped keep their page tables' references.
+static void
+shmput(struct shmseg *s)
+{
+	int i;
+
+	acquire(&shmtable.lock);
+	if (--s->ref == 0)
+	{
+		for (i = 0; i < s->npages; i++)
+			kfree(s->pages[i]);
+		s->npages = 0;
+	}
+	release(&shmtable.lock);
+}
+
+
+// Map segment id into the current process.
+// Returns its address, or -1.
+int
+shmat(int id)
+{
+	struct shmseg *s;
+	int i;
+
+	aslock(proc->as);
+	for (i = 0; i < NSHMPROC; i++)
+		if (proc->as->shm[i] == 0)
+			break;
+	if (i == NSHMPROC)
+		goto bad;
+
+	acquire(&shmtable.lock);
+	if ((s = shmfind(id)) == 0)
+	{
+		release(&shmtable.lock);
+		goto bad;
+	}
+	s->ref++;
+	release(&shmtable.lock);
+
+	// The attachment keeps s alive while mapping,
+	// which may allocate page tables.
+	if (mapshared(proc->as->pgdir, SHMADDR(i), s->pages, s->npages) < 0)
+	{
+		shmput(s);
+		goto bad;
+	}
+	proc->as->shm[i] = s;
+	asunlock(proc->as);
+	return SHMADDR(i);
+
+bad:
+	asunlock(proc->as);
+	return -1;
+}
+
+
+// Unmap the segment attached at addr in the current process.
+int
+shmdt(uint addr)
+{
+	struct shmseg *s;
+	int i;
+
+	aslock(proc->as);
+	for (i = 0; i < NSHMPROC; i++)
+		if (proc->as->shm[i] && SHMADDR(i) == addr)
+			break;
+	if (i == NSHMPROC ||
+			ubufbusy(addr, addr + proc->as->shm[i]->npages*PGSIZE))
+	{
+		asunlock(proc->as);
+		return -1;
+	}
+
+	s = proc->as->shm[i];
+	proc->as->shm[i] = 0;
+	deallocuvm(proc->as->pgdir, addr + s->npages*PGSIZE, addr);
+	switchuvm(proc);
+	tlbshootdown(proc->as);
+	asunlock(proc->as);
+	shmput(s);
+	return 0;
+}
+
+
+// Remove segment id, dropping the reference shmget made.
+int
+shmrm(int id)
+{
+	struct shmseg *s;
+
+	acquire(&shmtable.lock);
+	if ((s = shmfind(id)) == 0)
+	{
+		release(&shmtable.lock);
+		return -1;
+	}
+	s->removed = 1;
+	release(&shmtable.lock);
+	shmput(s);
+	return 0;
+}
+
+
+// Is [va, va+n) within one segment attached to the
+// current process? System calls may use such a buffer
+// like any other.
+int
+shmok(uint va, uint n)
+{
+	struct shmseg *s;
+	int i;
+
+	for (i = 0; i < NSHMPROC; i++)
+	{
+		if ((s = proc->as->shm[i]) != 0 && va >= SHMADDR(i) &&
+				va + n >= va && va + n <= SHMADDR(i) + s->npages*PGSIZE)
+			return 1;
+	}
+	return 0;
+}
+
+
+// Give np, a child being forked, the same attachments
+// as the current process, at the same addresses.
+// Returns 0, or -1 if there was no memory, in which case
+// the caller frees np's address space, with its attachments.
+int
+shmfork(struct proc *np)
+{
+	struct shmseg *s;
+	int i;
+
+	for (i = 0; i < NSHMPROC; i++)
+	{
+		if ((s = proc->as->shm[i]) == 0)
+			continue;
+		acquire(&shmtable.lock);
+		s->ref++;
+		release(&shmtable.lock);
+		np->as->shm[i] = s;
+		if (mapshared(np->as->pgdir, SHMADDR(i), s->pages, s->npages) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+// Detach address space as from all its segments, when its
+// last thread exits or execs. The mappings go away with
+// its page table.
+void
+shmrelease(struct aspace *as)
+{
+	int i;
+
+	for (i = 0; i < NSHMPROC; i++)
+	{
+		if (as->shm[i])
+		{
+			shmput(as->shm[i]);
+			as->shm[i] = 0;
+		}
+	}
+}
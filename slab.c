@@ -0,0 +1,268 @@
+// Slab allocator for small kernel objects.
+//
+// A cache (struct kmcache) hands out fixed-size objects
+// carved out of whole pages from kalloc(). Each slab page
+// begins with a struct slab header followed by as many
+// objects as fit; the free objects of a slab are chained
+// through their first word.
+//
+// Interface:
+// * kmcache_create() makes a cache for one object type,
+//		e.g. struct pipe, at initialization time.
+// * kmcache_alloc() returns an object from a cache.
+// * kmalloc(n) returns at least n bytes from one of a
+//		set of power-of-two size classes, up to KMALLOC_MAX.
+// * kmfree() frees an object from either. It finds the
+//		object's slab (and so its cache) by rounding the
+//		address down to a page boundary.
+//
+// Each cache keeps its slabs on two lists: partial (has
+// at least one free object) and full. A slab whose objects
+// are all free is given back to kalloc(), unless it is the
+// cache's only partial slab.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define NKMCACHE		24		// max number of caches
+#define KMALLOC_MIN		16		// smallest kmalloc() size class
+#define KMALLOC_MAX		2048	// largest kmalloc() size class
+
+// Header at the start of every slab page
+struct slab {
+	struct slab *next;		// on cache's partial or full list
+	struct slab *prev;
+	struct kmcache *cache;	// cache this slab belongs to
+	char *freelist;			// free objects in this slab
+	int inuse;				// allocated objects in this slab
+};
+
+struct kmcache {
+	struct spinlock lock;
+	char *name;
+	uint size;				// object size, rounded up
+	uint perslab;			// objects per slab page
+	struct slab *partial;	// slabs with free objects
+	struct slab *full;		// slabs with no free objects
+
+	// Statistics
+	uint nslabs;			// pages currently held
+	uint inuse;				// objects currently allocated
+	uint nalloc;			// total successful allocations
+	uint nfail;				// allocations that found no memory
+};
+
+struct {
+	struct spinlock lock;
+	struct kmcache cache[NKMCACHE];
+	int ncache;
+} kmtable;
+
+static struct kmcache *sizecache[8];	// kmalloc() classes, 16..2048
+
+void
+slabinit(void)
+{
+	uint size;
+	int i;
+	static char *names[] = {
+		"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+		"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+	};
+
+	initlock(&kmtable.lock, "kmtable");
+	for (i = 0, size = KMALLOC_MIN; size <= KMALLOC_MAX; i++, size *= 2)
+		sizecache[i] = kmcache_create(names[i], size);
+}
+
+
+// Create a cache of objects of the given size.
+// Caches are never destroyed.
+struct kmcache*
+kmcache_create(char *name, uint size)
+{
+	struct kmcache *c;
+
+	// Objects must be able to hold the free list link,
+	// and are kept 4-byte aligned.
+	if (size < sizeof(char*))
+		size = sizeof(char*);
+	size = (size + 3) & ~3;
+	if (sizeof(struct slab) + size > PGSIZE)
+		panic("kmcache_create: object too big");
+
+	acquire(&kmtable.lock);
+	if (kmtable.ncache >= NKMCACHE)
+		panic("kmcache_create: too many caches");
+	c = &kmtable.cache[kmtable.ncache++];
+	release(&kmtable.lock);
+
+	initlock(&c->lock, name);
+	c->name = name;
+	c->size = size;
+	c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+	return c;
+}
+
+
+static void
+slabpush(struct slab **list, struct slab *s)
+{
+	s->prev = 0;
+	s->next = *list;
+	if (s->next)
+		s->next->prev = s;
+	*list = s;
+}
+
+
+static void
+slabremove(struct slab **list, struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+
+// Get a fresh page from kalloc() and carve it
+// into objects. Caller must hold c->lock.
+static struct slab*
+slabgrow(struct kmcache *c)
+{
+	struct slab *s;
+	char *obj;
+	uint i;
+
+	if ((s = (struct slab*)kalloc()) == 0)
+		return 0;
+	s->cache = c;
+	s->inuse = 0;
+	s->freelist = 0;
+	obj = (char*)(s + 1);
+	for (i = 0; i < c->perslab; i++, obj += c->size)
+	{
+		*(char**)obj = s->freelist;
+		s->freelist = obj;
+	}
+	slabpush(&c->partial, s);
+	c->nslabs++;
+	return s;
+}
+
+
+// Allocate one object from cache c.
+// Returns 0 if no memory is available.
+void*
+kmcache_alloc(struct kmcache *c)
+{
+	struct slab *s;
+	char *obj;
+
+	acquire(&c->lock);
+	if ((s = c->partial) == 0 && (s = slabgrow(c)) == 0)
+	{
+		c->nfail++;
+		release(&c->lock);
+		return 0;
+	}
+
+	obj = s->freelist;
+	s->freelist = *(char**)obj;
+	s->inuse++;
+	if (s->freelist == 0)
+	{
+		slabremove(&c->partial, s);
+		slabpush(&c->full, s);
+	}
+	c->inuse++;
+	c->nalloc++;
+	release(&c->lock);
+	return obj;
+}
+
+
+// Allocate n bytes from the smallest size class that fits.
+// Requests larger than KMALLOC_MAX should use kalloc().
+void*
+kmalloc(uint n)
+{
+	int i;
+	uint size;
+
+	if (n > KMALLOC_MAX)
+		return 0;
+	for (i = 0, size = KMALLOC_MIN; size < n; i++, size *= 2)
+		;
+	return kmcache_alloc(sizecache[i]);
+}
+
+
+// Free an object returned by kmcache_alloc() or kmalloc().
+void
+kmfree(void *v)
+{
+	struct slab *s;
+	struct kmcache *c;
+
+	s = (struct slab*)PGROUNDDOWN((uint)v);
+	c = s->cache;
+	if (c < kmtable.cache || c >= &kmtable.cache[kmtable.ncache] ||
+			(char*)v < (char*)(s + 1))
+		panic("kmfree");
+
+#ifdef KJUNK
+	// Fill with junk to catch dangling refs (see kfree).
+	memset(v, 1, c->size);
+#endif
+
+	acquire(&c->lock);
+	if (s->freelist == 0)
+	{
+		slabremove(&c->full, s);
+		slabpush(&c->partial, s);
+	}
+	*(char**)v = s->freelist;
+	s->freelist = v;
+	s->inuse--;
+	c->inuse--;
+
+	// Give an empty slab back, keeping one around
+	// so that alloc/free pairs don't thrash kalloc().
+	if (s->inuse == 0 && (s->next || s->prev))
+	{
+		slabremove(&c->partial, s);
+		c->nslabs--;
+		release(&c->lock);
+		kfree((char*)s);
+		return;
+	}
+	release(&c->lock);
+}
+
+
+// Print per-cache usage to the console. FOR DEBUGGING.
+// Runs when a user types ^P on console.
+// No lock, like procdump().
+void
+kmcachedump(void)
+{
+	struct kmcache *c;
+
+	for (c = kmtable.cache; c < &kmtable.cache[kmtable.ncache]; c++)
+	{
+		if (c->nalloc == 0)
+			continue;
+		cprintf("%s: size %d, %d/%d objects in %d pages, "
+				"%d allocs, %d failed\n",
+				c->name, c->size, c->inuse, c->nslabs * c->perslab,
+				c->nslabs, c->nalloc, c->nfail);
+	}
+}
@@ -0,0 +1,15 @@
+// spawn() file actions. Each one changes the child's copy
+// of the caller's open files, in order, before it starts.
+#define SPAWN_OPEN		1		// open path with mode as fd
+#define SPAWN_CLOSE		2		// close fd
+#define SPAWN_DUP2		3		// make fd a copy of src
+
+#define NSPAWNFD		16		// max actions per spawn()
+
+struct spawnfd {
+	int op;					// SPAWN_OPEN, SPAWN_CLOSE or SPAWN_DUP2
+	int fd;					// descriptor in the child
+	int src;				// SPAWN_DUP2: descriptor to copy
+	int mode;				// SPAWN_OPEN: open() mode
+	char *path;				// SPAWN_OPEN: file to open
+};
@@ -0,0 +1,182 @@
+// Swap space.
+//
+// When memory runs out, swapout() in proc.c picks a cold
+// user page by the clock algorithm and writes it to a slot
+// in the swap area, a region of the disk past the file
+// system laid out by mkfs. The page's PTE keeps the slot
+// number, with PTE_SWAP set and PTE_P clear; the next touch
+// faults and pagefault() reads the page back in.
+//
+// Each slot has a reference count: fork copies a swapped
+// PTE as it is, and each process reads its own copy in.
+// A slot is busy while it is being written, and readers
+// wait for the write to finish.
+//
+// Slots are free when they have no references and are not
+// busy. Disk I/O goes around the buffer cache (bdirect),
+// through one buf of swap's own, since swapping happens
+// exactly when there is no memory to allocate one.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define SLOTBLOCKS	(PGSIZE/BSIZE)			// disk blocks per slot
+#define NSWAPSLOT	(SWAPBLOCKS/SLOTBLOCKS)	// max slots
+
+struct {
+	struct spinlock lock;
+	uint dev;
+	uint start;				// first block of the swap area
+	uint nslot;				// slots in the swap area
+	uint nfree;				// free slots
+	uchar ref[NSWAPSLOT];	// PTEs referring to each slot
+	uchar busy[NSWAPSLOT];	// being written out
+	struct buf buf;			// for all swap I/O, under its lock
+
+	// Statistics
+	uint nout;				// pages written out
+	uint nin;				// pages read back in
+} swap;
+
+
+// Find the swap area on dev. Until this runs,
+// there are no slots and swapout() finds no room.
+void
+swapinit(int dev)
+{
+	struct superblock sb;
+
+	initlock(&swap.lock, "swap");
+	initsleeplock(&swap.buf.lock, "swapbuf");
+	readsb(dev, &sb);
+	swap.dev = dev;
+	swap.start = sb.swapstart;
+	swap.nslot = sb.nswap / SLOTBLOCKS;
+	if (swap.nslot > NSWAPSLOT)
+		swap.nslot = NSWAPSLOT;
+	swap.nfree = swap.nslot;
+	cprintf("swap: %d pages at block %d\n", swap.nslot, swap.start);
+}
+
+
+// Number of free slots, for overcommit checks.
+uint
+swapfreepages(void)
+{
+	return swap.nfree;
+}
+
+
+// Allocate a slot, busy, with one reference.
+// Returns -1 if swap is full.
+int
+swapalloc(void)
+{
+	uint i;
+
+	acquire(&swap.lock);
+	for (i = 0; i < swap.nslot; i++)
+	{
+		if (swap.ref[i] == 0 && !swap.busy[i])
+		{
+			swap.ref[i] = 1;
+			swap.busy[i] = 1;
+			swap.nfree--;
+			release(&swap.lock);
+			return i;
+		}
+	}
+	release(&swap.lock);
+	return -1;
+}
+
+
+// Give back a slot from swapalloc() that was not used.
+void
+swapcancel(uint slot)
+{
+	acquire(&swap.lock);
+	swap.ref[slot] = 0;
+	swap.busy[slot] = 0;
+	swap.nfree++;
+	release(&swap.lock);
+}
+
+
+// Add a reference to slot, for a PTE copied by fork.
+void
+swapdup(uint slot)
+{
+	acquire(&swap.lock);
+	if (slot >= swap.nslot || swap.ref[slot] == 0 || swap.ref[slot] == 255)
+		panic("swapdup");
+	swap.ref[slot]++;
+	release(&swap.lock);
+}
+
+
+// Drop a reference to slot. It is free once it
+// has none left and is no longer being written.
+void
+swapfree(uint slot)
+{
+	acquire(&swap.lock);
+	if (slot >= swap.nslot || swap.ref[slot] == 0)
+		panic("swapfree");
+	if (--swap.ref[slot] == 0 && !swap.busy[slot])
+		swap.nfree++;
+	release(&swap.lock);
+}
+
+
+// Write the page at mem to slot, which must be busy,
+// and then mark it not busy. Sleeps.
+void
+swapwrite(uint slot, char *mem)
+{
+	acquiresleep(&swap.buf.lock);
+	bdirect(&swap.buf, swap.dev, swap.start + slot*SLOTBLOCKS, mem, SLOTBLOCKS, 1);
+	releasesleep(&swap.buf.lock);
+
+	acquire(&swap.lock);
+	swap.busy[slot] = 0;
+	swap.nout++;
+	if (swap.ref[slot] == 0)
+		swap.nfree++;
+	wakeup(&swap.busy[slot]);
+	release(&swap.lock);
+}
+
+
+// Read slot into the page at mem, once it has been written.
+// Sleeps.
+void
+swapread(uint slot, char *mem)
+{
+	acquire(&swap.lock);
+	while (swap.busy[slot])
+		sleep(&swap.busy[slot], &swap.lock);
+	swap.nin++;
+	release(&swap.lock);
+
+	acquiresleep(&swap.buf.lock);
+	bdirect(&swap.buf, swap.dev, swap.start + slot*SLOTBLOCKS, mem, SLOTBLOCKS, 0);
+	releasesleep(&swap.buf.lock);
+}
+
+
+// Print swap usage to the console. FOR DEBUGGING.
+// Runs when a user types ^P on console.
+// No lock, like procdump().
+void
+swapdump(void)
+{
+	cprintf("swap: %d/%d pages used, %d out, %d in\n",
+			swap.nslot - swap.nfree, swap.nslot, swap.nout, swap.nin);
+}
@@ -35,7 +35,7 @@ fetchint(uint addr, int *ip)
 	// will kill the process. The kernel, however, can dereference
 	// any address that the user might have passed, so it must
 	// check explicitly that the address is below p->sz.
-	if (addr >= proc->sz || addr+4 > proc->sz)
+	if (addr >= proc->as->sz || addr+4 > proc->as->sz)
 		return -1;
 	// We can simply cast the address to a pointer
 	// because the user and the kernel share the
@@ -53,11 +53,11 @@ fetchstr(uint addr, char **pp)
 {
 	char *s, *ep;
 
-	if (addr >= proc->sz)
+	if (addr >= proc->as->sz)
 		return -1;
 
 	*pp = (char*)addr;
-	ep = (char*)proc->sz;
+	ep = (char*)proc->as->sz;
 	for (s = *pp; s < ep; s++)
 	{
 		if (*s == 0)
@@ -81,10 +81,11 @@ argint(int n, int *ip)
 
 
 // Fetch the nth word-sized system call arg as a pointer
-// to a block of memory of size n bytes.
+// to a block of memory of size n bytes, which the kernel
+// will write if write is set.
 // Check that the pointer lies within the process addr space.
-int
-argptr(int n, char **pp, int size)
+static int
+argbuf(int n, char **pp, int size, int write)
 {
 	int i;
 
@@ -94,8 +95,24 @@ argptr(int n, char **pp, int size)
 		return -1;
 
 	// Then the argument, which is also a user pointer,
-	// is checked.
-	if ((uint)i >= proc->sz || (uint)i + size > proc->sz)
+	// is checked. Besides the heap, it may point into an
+	// mmap() region or an attached shared memory segment.
+	if (((uint)i >= proc->as->sz || (uint)i + size > proc->as->sz) &&
+			!vmaok(i, size, write) && !shmok(i, size))
+		return -1;
+
+	// Pages not yet touched must be filled in now,
+	// while no locks are held (see pagefault). Other
+	// threads must then leave them mapped until the
+	// call returns (see ubufbusy); recording the range
+	// under aslock orders this against their unmapping.
+	if (proc->as->ref > 1)
+		aslock(proc->as);
+	proc->ubuf = i;
+	proc->ubufend = i + size;
+	if (proc->as->ref > 1)
+		asunlock(proc->as);
+	if (prefault(i, size, write) < 0)
 		return -1;
 
 	*pp = (char*)i;
@@ -103,6 +120,24 @@ argptr(int n, char **pp, int size)
 }
 
 
+// Fetch a pointer to a buffer the kernel only reads.
+int
+argptr(int n, char **pp, int size)
+{
+	return argbuf(n, pp, size, 0);
+}
+
+
+// Fetch a pointer to a buffer the kernel writes. Its
+// copy-on-write pages are copied now, so that a failure
+// to allocate fails the system call.
+int
+argwptr(int n, char **pp, int size)
+{
+	return argbuf(n, pp, size, 1);
+}
+
+
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
 //	(There is no shared writable memory, so the string cannot change
@@ -141,6 +176,23 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_symlink(void);
 extern int sys_uptime(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_shmrm(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_spawn(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futexwait(void);
+extern int sys_futexwake(void);
+extern int sys_setpriority(void);
+extern int sys_settickets(void);
+extern int sys_setaffinity(void);
+extern int sys_getaffinity(void);
+extern int sys_setrealtime(void);
+extern int sys_vmstat(void);
 
 
 static int (*syscalls[])(void) = {
@@ -166,6 +218,23 @@ static int (*syscalls[])(void) = {
 [SYS_mkdir]		sys_mkdir,
 [SYS_close]		sys_close,
 [SYS_symlink]	sys_symlink,
+[SYS_shmget]	sys_shmget,
+[SYS_shmat]		sys_shmat,
+[SYS_shmdt]		sys_shmdt,
+[SYS_mmap]		sys_mmap,
+[SYS_munmap]	sys_munmap,
+[SYS_spawn]		sys_spawn,
+[SYS_clone]		sys_clone,
+[SYS_join]		sys_join,
+[SYS_futexwait]	sys_futexwait,
+[SYS_futexwake]	sys_futexwake,
+[SYS_setpriority]	sys_setpriority,
+[SYS_settickets]	sys_settickets,
+[SYS_setaffinity]	sys_setaffinity,
+[SYS_getaffinity]	sys_getaffinity,
+[SYS_setrealtime]	sys_setrealtime,
+[SYS_shmrm]		sys_shmrm,
+[SYS_vmstat]	sys_vmstat,
 };
 
 
@@ -183,6 +252,12 @@ syscall(void)
 		// Record the return value of the system
 		// call function in %eax
 		proc->tf->eax = syscalls[num]();
+		proc->ubuf = proc->ubufend = 0;
+		if (proc->argf)
+		{
+			fileclose(proc->argf);
+			proc->argf = 0;
+		}
 	}
 	// If the system call number is invalid...
 	else
@@ -21,3 +21,20 @@
 #define SYS_mkdir	20
 #define SYS_close	21
 #define SYS_symlink	22
+#define SYS_shmget	23
+#define SYS_shmat	24
+#define SYS_shmdt	25
+#define SYS_mmap	26
+#define SYS_munmap	27
+#define SYS_spawn	28
+#define SYS_clone	29
+#define SYS_join	30
+#define SYS_futexwait	31
+#define SYS_futexwake	32
+#define SYS_setpriority	33
+#define SYS_settickets	34
+#define SYS_setaffinity	35
+#define SYS_getaffinity	36
+#define SYS_setrealtime	37
+#define SYS_shmrm	38
+#define SYS_vmstat	39
@@ -17,10 +17,15 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call arg as a
 // file descriptor and return both the descriptor
 // and the corresponding struct file.
+// If other threads share the descriptors, one of them
+// could close it meanwhile, so hold a reference to the
+// file until the system call returns (see syscall).
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -29,8 +34,17 @@ argfd(int n, int *pfd, struct file **pf)
 
 	if (argint(n, &fd) < 0)
 		return -1;
-	if (fd < 0 || fd >= NOFILE || (f=proc->ofile[fd]) == 0)
+	if (fd < 0 || fd >= NOFILE)
 		return -1;
+	acquire(&proc->fdt->lock);
+	if ((f=proc->fdt->ofile[fd]) == 0)
+	{
+		release(&proc->fdt->lock);
+		return -1;
+	}
+	if (proc->fdt->ref > 1 && proc->argf == 0)
+		proc->argf = filedup(f);
+	release(&proc->fdt->lock);
 	if (pfd)
 		*pfd = fd;
 	if (pf)
@@ -47,14 +61,17 @@ fdalloc(struct file *f)
 {
 	int fd;
 
+	acquire(&proc->fdt->lock);
 	for (fd = 0; fd < NOFILE; fd++)
 	{
-		if (proc->ofile[fd] == 0)
+		if (proc->fdt->ofile[fd] == 0)
 		{
-			proc->ofile[fd] = f;
+			proc->fdt->ofile[fd] = f;
+			release(&proc->fdt->lock);
 			return fd;
 		}
 	}
+	release(&proc->fdt->lock);
 	return -1;
 }
 
@@ -81,7 +98,7 @@ sys_read(void)
 	int n;
 	char *p;
 
-	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+	if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argwptr(1, &p, n) < 0)
 		return -1;
 	return fileread(f, p, n);
 }
@@ -108,7 +125,15 @@ sys_close(void)
 
 	if(argfd(0, &fd, &f) < 0)
 		return -1;
-	proc->ofile[fd] = 0;
+	// Another thread may have closed it since argfd()
+	acquire(&proc->fdt->lock);
+	if (proc->fdt->ofile[fd] != f)
+	{
+		release(&proc->fdt->lock);
+		return -1;
+	}
+	proc->fdt->ofile[fd] = 0;
+	release(&proc->fdt->lock);
 	fileclose(f);
 	return 0;
 }
@@ -120,12 +145,66 @@ sys_fstat(void)
 	struct file *f;
 	struct stat *st;
 
-	if (argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+	if (argfd(0, 0, &f) < 0 || argwptr(1, (void*)&st, sizeof(*st)) < 0)
 		return -1;
 	return filestat(f, st);
 }
 
 
+// Map length bytes of an open file, from offset, into
+// memory. The kernel picks the address: addr must be 0.
+int
+sys_mmap(void)
+{
+	int addr, length, prot, flags, offset, vflags;
+	struct file *f;
+	struct inode *ip;
+
+	if (argint(0, &addr) < 0 || argint(1, &length) < 0 || argint(2, &prot) < 0 ||
+			argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &offset) < 0)
+		return -1;
+	if (addr != 0 || length <= 0 || offset < 0 || offset % PGSIZE != 0)
+		return -1;
+	if (f->type != FD_INODE || !f->readable)
+		return -1;
+
+	vflags = 0;
+	if (prot & PROT_WRITE)
+		vflags |= VMA_WRITE;
+	if (flags == MAP_SHARED)
+	{
+		// Writes will reach the file.
+		if ((prot & PROT_WRITE) && !f->writable)
+			return -1;
+		vflags |= VMA_SHARED;
+	}
+	else if (flags != MAP_PRIVATE)
+		return -1;
+
+	ip = f->ip;
+	ilock(ip);
+	if (ip->type != T_FILE)
+	{
+		iunlock(ip);
+		return -1;
+	}
+	iunlock(ip);
+
+	return vmamap(ip, length, vflags, offset);
+}
+
+
+int
+sys_munmap(void)
+{
+	int addr, length;
+
+	if (argint(0, &addr) < 0 || argint(1, &length) < 0)
+		return -1;
+	return vmaunmap(addr, length);
+}
+
+
 // Create the path new as a link to the same inode as old
 int
 sys_link(void)
@@ -282,7 +361,10 @@ create(char *path, short type, short major, short minor)
 	}
 
 	if ((ip = ialloc(dp->dev, type)) == 0)
-		panic("create: ialloc");
+	{
+		iunlockput(dp);
+		return 0;
+	}
 
 	ilock(ip);
 	ip->major = major;
@@ -300,8 +382,21 @@ create(char *path, short type, short major, short minor)
 			panic("create: dots");
 	}
 
+	// dirlookup() may have found nothing only for lack
+	// of memory, and dirlink() then finds the name.
 	if (dirlink(dp, name, ip->inum) < 0)
-		panic("create: dirlink");
+	{
+		if (type == T_DIR)
+		{
+			dp->nlink--;
+			iupdate(dp);
+		}
+		ip->nlink = 0;
+		iupdate(ip);
+		iunlockput(ip);
+		iunlockput(dp);
+		return 0;
+	}
 
 	iunlockput(dp);
 
@@ -325,17 +420,14 @@ sys_symlink(void)
 }
 
 
-int
-sys_open(void)
+// Open the file at path with mode omode, as open() does,
+// and return it, or 0 on failure.
+static struct file*
+openfile(char *path, int omode)
 {
-	char *path;
-	int fd, omode;
 	struct file *f;
 	struct inode *ip;
 
-	if (argstr(0, &path) < 0 || argint(1, &omode) < 0)
-		return -1;
-
 	begin_op();
 
 	if (omode & O_CREATE)
@@ -344,7 +436,7 @@ sys_open(void)
 		if (ip == 0)
 		{
 			end_op();
-			return -1;
+			return 0;
 		}
 	}
 	else
@@ -352,25 +444,22 @@ sys_open(void)
 		if ((ip = namei(path)) == 0)
 		{
 			end_op();
-			return -1;
+			return 0;
 		}
 		ilock(ip);
 		if(ip->type == T_DIR && omode != O_RDONLY)
 		{
 			iunlockput(ip);
 			end_op();
-			return -1;
+			return 0;
 		}
 	}
 
-	if ((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0)
+	if ((f = filealloc()) == 0)
 	{
-		if(f)
-			fileclose(f);
-
 		iunlockput(ip);
 		end_op();
-		return -1;
+		return 0;
 	}
 	iunlock(ip);
 	end_op();
@@ -380,6 +469,26 @@ sys_open(void)
 	f->off = 0;
 	f->readable = !(omode & O_WRONLY);
 	f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+	return f;
+}
+
+
+int
+sys_open(void)
+{
+	char *path;
+	int fd, omode;
+	struct file *f;
+
+	if (argstr(0, &path) < 0 || argint(1, &omode) < 0)
+		return -1;
+	if ((f = openfile(path, omode)) == 0)
+		return -1;
+	if ((fd = fdalloc(f)) < 0)
+	{
+		fileclose(f);
+		return -1;
+	}
 	return fd;
 }
 
@@ -430,7 +539,7 @@ int
 sys_chdir(void)
 {
 	char *path;
-	struct inode *ip;
+	struct inode *ip, *old;
 
 	begin_op();
 	if (argstr(0, &path) < 0 || (ip = namei(path)) == 0)
@@ -446,29 +555,28 @@ sys_chdir(void)
 		return -1;
 	}
 	iunlock(ip);
-	iput(proc->cwd);
+	acquire(&proc->fdt->lock);
+	old = proc->fdt->cwd;
+	proc->fdt->cwd = ip;
+	release(&proc->fdt->lock);
+	iput(old);
 	end_op();
-	proc->cwd = ip;
 	return 0;
 }
 
 
-int
-sys_exec(void)
+// Fetch the null-terminated array of string pointers at
+// user address uargv into argv, which holds MAXARG.
+static int
+fetchargv(uint uargv, char **argv)
 {
-	char *path, *argv[MAXARG];
 	int i;
-	uint uargv, uarg;
+	uint uarg;
 
-	if (argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0)
-	{
-		return -1;
-	}
-
-	memset(argv, 0, sizeof(argv));
+	memset(argv, 0, MAXARG*sizeof(argv[0]));
 	for (i = 0; ;i++)
 	{
-		if (i >= NELEM(argv))
+		if (i >= MAXARG)
 			return -1;
 		if (fetchint(uargv + 4 * i, (int*)&uarg) < 0)
 			return -1;
@@ -480,10 +588,96 @@ sys_exec(void)
 		if (fetchstr(uarg, &argv[i]) < 0)
 			return -1;
 	}
+	return 0;
+}
+
+
+int
+sys_exec(void)
+{
+	char *path, *argv[MAXARG];
+	uint uargv;
+
+	if (argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0)
+	{
+		return -1;
+	}
+	if (fetchargv(uargv, argv) < 0)
+		return -1;
 	return exec(path, argv);
 }
 
 
+// Apply the spawn() file action a to ofile[], the open
+// files of the child being set up.
+static int
+spawnfd(struct file **ofile, struct spawnfd *a)
+{
+	struct file *f;
+	char *path;
+
+	if (a->fd < 0 || a->fd >= NOFILE)
+		return -1;
+	switch (a->op)
+	{
+		case SPAWN_OPEN:
+			if (fetchstr((uint)a->path, &path) < 0 || (f = openfile(path, a->mode)) == 0)
+				return -1;
+			break;
+		case SPAWN_CLOSE:
+			f = 0;
+			break;
+		case SPAWN_DUP2:
+			if (a->src < 0 || a->src >= NOFILE || ofile[a->src] == 0)
+				return -1;
+			f = filedup(ofile[a->src]);
+			break;
+		default:
+			return -1;
+	}
+	if (ofile[a->fd])
+		fileclose(ofile[a->fd]);
+	ofile[a->fd] = f;
+	return 0;
+}
+
+
+int
+sys_spawn(void)
+{
+	char *path, *argv[MAXARG];
+	struct file *ofile[NOFILE];
+	struct spawnfd *fa;
+	int i, n;
+	uint uargv;
+
+	if (argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 || argint(3, &n) < 0)
+		return -1;
+	if (n < 0 || n > NSPAWNFD || argptr(2, (void*)&fa, n*sizeof(fa[0])) < 0)
+		return -1;
+	if (fetchargv(uargv, argv) < 0)
+		return -1;
+
+	// The child starts with the caller's open files,
+	// then the actions change them in order.
+	acquire(&proc->fdt->lock);
+	for (i = 0; i < NOFILE; i++)
+		ofile[i] = proc->fdt->ofile[i] ? filedup(proc->fdt->ofile[i]) : 0;
+	release(&proc->fdt->lock);
+	for (i = 0; i < n; i++)
+	{
+		if (spawnfd(ofile, &fa[i]) < 0)
+		{
+			for (i = 0; i < NOFILE; i++)
+				if (ofile[i])
+					fileclose(ofile[i]);
+			return -1;
+		}
+	}
+	return spawn(path, argv, ofile);
+}
+
+
 int
 sys_pipe(void)
 {
@@ -491,7 +685,7 @@ sys_pipe(void)
 	struct file *rf, *wf;
 	int fd0, fd1;
 
-	if (argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+	if (argwptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
 		return -1;
 	if (pipealloc(&rf, &wf) < 0)
 		return -1;
@@ -499,7 +693,11 @@ sys_pipe(void)
 	if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0)
 	{
 		if (fd0 >= 0)
-			proc->ofile[fd0] = 0;
+		{
+			acquire(&proc->fdt->lock);
+			proc->fdt->ofile[fd0] = 0;
+			release(&proc->fdt->lock);
+		}
 
 		fileclose(rf);
 		fileclose(wf);
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "vmstat.h"
 
 int
 sys_fork(void)
@@ -29,6 +30,33 @@ sys_wait(void)
 }
 
 
+int
+sys_clone(void)
+{
+	int fcn, arg1, arg2, ustack;
+
+	if (argint(0, &fcn) < 0 || argint(1, &arg1) < 0 ||
+			argint(2, &arg2) < 0 || argint(3, &ustack) < 0)
+		return -1;
+	return clone(fcn, arg1, arg2, ustack);
+}
+
+
+int
+sys_join(void)
+{
+	char *p;
+	uint ustack;
+	int pid;
+
+	if (argwptr(0, &p, sizeof(void*)) < 0)
+		return -1;
+	if ((pid = join(&ustack)) >= 0)
+		*(uint*)p = ustack;
+	return pid;
+}
+
+
 int
 sys_kill(void)
 {
@@ -57,7 +85,7 @@ sys_sbrk(void)
 	if (argint(0, &n) < 0)
 		return -1;
 
-	addr = proc->sz;
+	addr = proc->as->sz;
 	if (growproc(n) < 0)
 		return -1;
 
@@ -65,6 +93,151 @@ sys_sbrk(void)
 }
 
 
+int
+sys_shmget(void)
+{
+	int key, size;
+
+	if (argint(0, &key) < 0 || argint(1, &size) < 0)
+		return -1;
+	return shmget(key, size);
+}
+
+
+int
+sys_shmat(void)
+{
+	int id;
+
+	if (argint(0, &id) < 0)
+		return -1;
+	return shmat(id);
+}
+
+
+int
+sys_shmdt(void)
+{
+	int addr;
+
+	if (argint(0, &addr) < 0)
+		return -1;
+	return shmdt(addr);
+}
+
+
+int
+sys_shmrm(void)
+{
+	int id;
+
+	if (argint(0, &id) < 0)
+		return -1;
+	return shmrm(id);
+}
+
+
+int
+sys_setpriority(void)
+{
+	int pid, nice;
+
+	if (argint(0, &pid) < 0 || argint(1, &nice) < 0)
+		return -1;
+	return setpriority(pid, nice);
+}
+
+
+int
+sys_settickets(void)
+{
+	int n;
+
+	if (argint(0, &n) < 0)
+		return -1;
+	return settickets(n);
+}
+
+
+int
+sys_setaffinity(void)
+{
+	int pid, mask;
+
+	if (argint(0, &pid) < 0 || argint(1, &mask) < 0)
+		return -1;
+	return setaffinity(pid, mask);
+}
+
+
+int
+sys_getaffinity(void)
+{
+	int pid;
+
+	if (argint(0, &pid) < 0)
+		return -1;
+	return getaffinity(pid);
+}
+
+
+int
+sys_setrealtime(void)
+{
+	int period, runtime, deadline;
+
+	if (argint(0, &period) < 0 || argint(1, &runtime) < 0 ||
+			argint(2, &deadline) < 0)
+		return -1;
+	return setrealtime(period, runtime, deadline);
+}
+
+
+// Report the current process's paging statistics,
+// which procdump() prints too.
+int
+sys_vmstat(void)
+{
+	struct vmstat *st;
+
+	if (argwptr(0, (char**)&st, sizeof(*st)) < 0)
+		return -1;
+	st->nzfault = proc->nzfault;
+	st->nfilefault = proc->nfilefault;
+	st->ncowfault = proc->ncowfault;
+	st->nswapin = proc->nswapin;
+	st->npromote = proc->npromote;
+	aslock(proc->as);
+	st->nsuper = nsuper(proc->as->pgdir, proc->as->sz);
+	asunlock(proc->as);
+	return 0;
+}
+
+
+int
+sys_futexwait(void)
+{
+	char *addr;
+	int val;
+
+	if (argptr(0, &addr, sizeof(uint)) < 0 || argint(1, &val) < 0)
+		return -1;
+	return futexwait((uint)addr, val);
+}
+
+
+int
+sys_futexwake(void)
+{
+	char *addr;
+	int n;
+
+	if (argptr(0, &addr, sizeof(uint)) < 0 || argint(1, &n) < 0)
+		return -1;
+	return futexwake((uint)addr, n);
+}
+
+
 int
 sys_sleep(void)
 {
@@ -107,6 +107,14 @@ trap(struct trapframe *tf)
 				lapiceoi();
 				break;
 
+		// Another CPU changed the page table of the thread
+		// running here (see tlbshootdown in vm.c).
+		case T_TLBFLUSH:
+				lcr3(rcr3());
+				cpu->ntlbflush++;
+				lapiceoi();
+				break;
+
 		// In addition to the expected hardware devices, a trap
 		// can be caused by a spurious interrupt, an unwanted
 		// hardware interrupt.
@@ -117,6 +125,17 @@ trap(struct trapframe *tf)
 				lapiceoi();
 				break;
 
+		// A page fault may be the first touch of heap memory
+		// that sbrk() only reserved, or a write to a page shared
+		// copy-on-write since fork(); if so, pagefault() fills
+		// in the page and the instruction is retried. The kernel
+		// takes the same faults when it touches user memory on
+		// the process' behalf (e.g. in read()).
+		case T_PGFLT:
+				if (proc && pagefault(rcr2()) == 0)
+					break;
+				// Not a page we fill on demand: fall through
+
 		// If the trap is not a system call, and not a hardware
 		// device looking for attention, we assume it was caused
 		// by incorrect behavior (e.g. divide by zero) as part of
@@ -149,9 +168,11 @@ trap(struct trapframe *tf)
 	if (proc && proc->killed && (tf->cs&3) == DPL_USER)
 		exit();
 
-	// Force process to give up CPU on clock tick.
+	// Force process to give up CPU on clock tick, if the
+	// scheduling policy says so.
 	// If interrupts were on while locks held, would need to check nlock.
-	if (proc && proc->state == RUNNING && tf->trapno == T_IRQ0+IRQ_TIMER)
+	if (proc && proc->state == RUNNING && tf->trapno == T_IRQ0+IRQ_TIMER &&
+			schedtick())
 		yield();
 
 	// Check if the process has been killed since we yielded
@@ -25,6 +25,7 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL			64		// system call
+#define T_TLBFLUSH			65		// flush TLB (IPI from tlbshootdown)
 #define T_DEFAULT			500		// catchall
 
 #define T_IRQ0				32		// IRQ 0 corresponds to int T_IRQ
@@ -1,5 +1,16 @@
 struct stat;
 struct rtcdate;
+struct spawnfd;
+struct vmstat;
+
+// uthread.c lock and condition variable
+struct lock_t {
+	volatile uint locked;
+};
+
+struct cond_t {
+	volatile uint seq;
+};
 
 // system calls
 int fork(void);
@@ -24,6 +35,23 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int symlink(int);
+int shmget(int, int);
+void* shmat(int);
+int shmdt(void*);
+int shmrm(int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int spawn(char*, char**, struct spawnfd*, int);
+int clone(void(*)(void*, void*), void*, void*, void*);
+int join(void**);
+int futexwait(void*, int);
+int futexwake(void*, int);
+int setpriority(int, int);
+int settickets(int);
+int setaffinity(int, int);
+int getaffinity(int);
+int setrealtime(int, int, int);
+int vmstat(struct vmstat*);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -38,3 +66,14 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+
+// uthread.c
+int thread_create(void(*)(void*, void*), void*, void*);
+int thread_join(void);
+void lock_init(struct lock_t*);
+void lock_acquire(struct lock_t*);
+void lock_release(struct lock_t*);
+void cond_init(struct cond_t*);
+void cond_wait(struct cond_t*, struct lock_t*);
+void cond_signal(struct cond_t*);
+void cond_broadcast(struct cond_t*);
@@ -4,6 +4,9 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "spawn.h"
+#include "vmstat.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -300,6 +303,386 @@ exectest(void)
   }
 }
 
+// threads from clone() share memory; join() returns each one
+struct lock_t clonelock;
+int clonecount;
+
+void
+cloneworker(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    lock_acquire(&clonelock);
+    clonecount++;
+    lock_release(&clonelock);
+  }
+  *(int*)a1 = (int)a2;
+  exit();
+}
+
+void
+cloneopen(void *a1, void *a2)
+{
+  *(int*)a1 = open("clonefd", O_CREATE|O_RDWR);
+  exit();
+}
+
+void
+clonetest(void)
+{
+  int i, pid, pids[4], vals[4];
+
+  printf(stdout, "clone test\n");
+  lock_init(&clonelock);
+  clonecount = 0;
+  for(i = 0; i < 4; i++){
+    vals[i] = 0;
+    pids[i] = thread_create(cloneworker, &vals[i], (void*)(i + 1));
+    if(pids[i] < 0){
+      printf(stdout, "clone failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++){
+    pid = thread_join();
+    if(pid != pids[0] && pid != pids[1] && pid != pids[2] && pid != pids[3]){
+      printf(stdout, "join returned wrong pid %d\n", pid);
+      exit();
+    }
+  }
+  if(thread_join() != -1 || wait() != -1){
+    printf(stdout, "join or wait found an extra child\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    if(vals[i] != i + 1){
+      printf(stdout, "thread did not write shared memory\n");
+      exit();
+    }
+  }
+  if(clonecount != 4000){
+    printf(stdout, "clone count %d, not 4000\n", clonecount);
+    exit();
+  }
+
+  // a file opened by a thread stays open for the others
+  if(thread_create(cloneopen, &vals[0], 0) < 0 || thread_join() < 0){
+    printf(stdout, "clone failed\n");
+    exit();
+  }
+  if(vals[0] < 0 || write(vals[0], "x", 1) != 1){
+    printf(stdout, "thread's open file not shared\n");
+    exit();
+  }
+  close(vals[0]);
+  unlink("clonefd");
+  printf(stdout, "clone test ok\n");
+}
+
+// threads block in futexwait() on a lock and condition variable
+struct lock_t futexlock;
+struct cond_t futexcv;
+int futexitems;
+
+void
+futexconsumer(void *a1, void *a2)
+{
+  int i;
+
+  for(i = 0; i < 100; i++){
+    lock_acquire(&futexlock);
+    while(futexitems == 0)
+      cond_wait(&futexcv, &futexlock);
+    futexitems--;
+    lock_release(&futexlock);
+  }
+  exit();
+}
+
+void
+futextest(void)
+{
+  int i, w;
+
+  printf(stdout, "futex test\n");
+  w = 1;
+  if(futexwait(&w, 0) != -1){
+    printf(stdout, "futexwait slept on a changed word\n");
+    exit();
+  }
+  if(futexwake(&w, 1) != 0){
+    printf(stdout, "futexwake woke a thread from nowhere\n");
+    exit();
+  }
+
+  lock_init(&futexlock);
+  cond_init(&futexcv);
+  futexitems = 0;
+  for(i = 0; i < 2; i++){
+    if(thread_create(futexconsumer, 0, 0) < 0){
+      printf(stdout, "futex clone failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < 200; i++){
+    lock_acquire(&futexlock);
+    futexitems++;
+    cond_signal(&futexcv);
+    lock_release(&futexlock);
+    if(i % 50 == 0)
+      sleep(1);
+  }
+  for(i = 0; i < 2; i++){
+    if(thread_join() < 0){
+      printf(stdout, "futex join failed\n");
+      exit();
+    }
+  }
+  if(futexitems != 0){
+    printf(stdout, "futex items left %d\n", futexitems);
+    exit();
+  }
+  printf(stdout, "futex test ok\n");
+}
+
+// setpriority() returns the old nice value, which fork copies
+void
+prioritytest(void)
+{
+  int pid;
+
+  printf(stdout, "priority test\n");
+  if(setpriority(getpid(), NMLFQ) != -1 || setpriority(getpid(), -1) != -1){
+    printf(stdout, "setpriority accepted a bad nice value\n");
+    exit();
+  }
+  if(setpriority(getpid(), NMLFQ-1) != 0){
+    printf(stdout, "setpriority: nice was not 0\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "priority fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(setpriority(getpid(), 0) != NMLFQ-1)
+      printf(stdout, "child did not inherit nice value\n");
+    exit();
+  }
+  wait();
+  if(setpriority(getpid(), 0) != NMLFQ-1){
+    printf(stdout, "setpriority lost nice value\n");
+    exit();
+  }
+  printf(stdout, "priority test ok\n");
+}
+
+// settickets() checks its argument; with the stride scheduler,
+// processes with 3 times the tickets get about 3 times the CPU
+void
+stridetest(void)
+{
+#ifdef SCHED_STRIDE
+  int i, j, pid, start, fds[2];
+  uint hi, lo, r[2];
+  volatile int x;
+#endif
+
+  printf(stdout, "stride test\n");
+  if(settickets(0) != -1 || settickets(MAXTICKETS+1) != -1){
+    printf(stdout, "settickets accepted a bad count\n");
+    exit();
+  }
+#ifdef SCHED_STRIDE
+  if(pipe(fds) != 0){
+    printf(stdout, "stride pipe failed\n");
+    exit();
+  }
+  // More spinners than CPUs, half of them with 300 tickets
+  // and half with 100, all counting for the same 100 ticks.
+  start = uptime() + 10;
+  for(i = 0; i < 16; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "stride fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      settickets(i < 8 ? 300 : 100);
+      while(uptime() < start)
+        ;
+      r[0] = i < 8;
+      r[1] = 0;
+      while(uptime() < start + 100){
+        for(j = 0; j < 1000; j++)
+          x++;
+        r[1]++;
+      }
+      write(fds[1], r, sizeof(r));
+      exit();
+    }
+  }
+  close(fds[1]);
+  hi = lo = 0;
+  for(i = 0; i < 16; i++){
+    if(read(fds[0], r, sizeof(r)) != sizeof(r)){
+      printf(stdout, "stride read failed\n");
+      exit();
+    }
+    if(r[0])
+      hi += r[1];
+    else
+      lo += r[1];
+    wait();
+  }
+  close(fds[0]);
+  if(hi < 2*lo || hi > 4*lo){
+    printf(stdout, "stride share %d:%d, not about 3:1\n", hi, lo);
+    exit();
+  }
+#endif
+  printf(stdout, "stride test ok\n");
+}
+
+// setaffinity() restricts the CPUs a process may use; fork copies it
+void
+affinitytest(void)
+{
+  int mask, pid;
+
+  printf(stdout, "affinity test\n");
+  mask = getaffinity(getpid());
+  if((mask & 1) == 0){
+    printf(stdout, "getaffinity: cpu 0 not allowed\n");
+    exit();
+  }
+  if(setaffinity(getpid(), 0) != -1){
+    printf(stdout, "setaffinity accepted an empty mask\n");
+    exit();
+  }
+  if(setaffinity(getpid(), 1) != 0 || getaffinity(getpid()) != 1){
+    printf(stdout, "setaffinity failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "affinity fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(getaffinity(getpid()) != 1)
+      printf(stdout, "child did not inherit affinity\n");
+    exit();
+  }
+  wait();
+  if(setaffinity(getpid(), mask) != 0){
+    printf(stdout, "setaffinity could not restore mask\n");
+    exit();
+  }
+  printf(stdout, "affinity test ok\n");
+}
+
+// setrealtime() admits only what the CPUs can schedule by deadline
+void
+realtimetest(void)
+{
+  int pid, start;
+  volatile int x;
+
+  printf(stdout, "realtime test\n");
+  if(setrealtime(10, 11, 10) != -1 || setrealtime(10, 5, 11) != -1 ||
+     setrealtime(10, -1, 10) != -1){
+    printf(stdout, "setrealtime accepted bad parameters\n");
+    exit();
+  }
+  if(setrealtime(10, 5, 10) != 0){
+    printf(stdout, "setrealtime refused half a cpu\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "realtime fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // A whole CPU more can never be admitted beside it.
+    if(setrealtime(1, 1, 1) != -1)
+      printf(stdout, "setrealtime over-admitted\n");
+    exit();
+  }
+  wait();
+
+  // Spin past the budget, so that it is throttled and
+  // resumes in later periods.
+  start = uptime();
+  while(uptime() < start + 30)
+    x++;
+  if(setrealtime(0, 0, 0) != 0){
+    printf(stdout, "setrealtime could not leave real-time class\n");
+    exit();
+  }
+  printf(stdout, "realtime test ok\n");
+}
+
+// spawn echo with its output sent to a file, then to a pipe
+void
+spawntest(void)
+{
+  char *argv[] = { "echo", "spawned", 0 };
+  struct spawnfd fa[3];
+  int fd, fds[2], pid, n;
+
+  printf(stdout, "spawn test\n");
+  if(spawn("nonexistent", argv, 0, 0) >= 0){
+    printf(stdout, "spawn nonexistent succeeded\n");
+    exit();
+  }
+
+  unlink("spawnout");
+  fa[0].op = SPAWN_OPEN;
+  fa[0].fd = 1;
+  fa[0].mode = O_CREATE|O_WRONLY;
+  fa[0].path = "spawnout";
+  pid = spawn("echo", argv, fa, 1);
+  if(pid < 0 || wait() != pid){
+    printf(stdout, "spawn echo failed\n");
+    exit();
+  }
+  fd = open("spawnout", O_RDONLY);
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink("spawnout");
+  if(n != 8 || buf[0] != 's' || buf[6] != 'd' || buf[7] != '\n'){
+    printf(stdout, "spawn echo wrong output\n");
+    exit();
+  }
+
+  if(pipe(fds) != 0){
+    printf(stdout, "spawn pipe failed\n");
+    exit();
+  }
+  fa[0].op = SPAWN_DUP2;
+  fa[0].fd = 1;
+  fa[0].src = fds[1];
+  fa[1].op = SPAWN_CLOSE;
+  fa[1].fd = fds[0];
+  fa[2].op = SPAWN_CLOSE;
+  fa[2].fd = fds[1];
+  pid = spawn("echo", argv, fa, 3);
+  close(fds[1]);
+  for(n = 0; pid >= 0 && (fd = read(fds[0], buf + n, sizeof(buf) - n)) > 0; n += fd)
+    ;
+  if(pid < 0 || n != 8 || buf[0] != 's'){
+    printf(stdout, "spawn echo to pipe failed\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  printf(stdout, "spawn test ok\n");
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1200,6 +1583,69 @@ bigfile(void)
   printf(1, "bigfile test ok\n");
 }
 
+// file data is read through the page cache: reads must
+// see later writes, and a deleted file's cached pages
+// must not show up in a new file that reuses its inode
+void
+pcachetest(void)
+{
+  int fd, i, j;
+
+  printf(1, "pcache test\n");
+
+  for(j = 0; j < 2; j++){
+    unlink("pcfile");
+    fd = open("pcfile", O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf(1, "pcache test create failed\n");
+      exit();
+    }
+    for(i = 0; i < 3*4096; i += 512){
+      memset(buf, 'a' + j + i/4096, 512);
+      if(write(fd, buf, 512) != 512){
+        printf(1, "pcache test write failed\n");
+        exit();
+      }
+    }
+    close(fd);
+
+    // fill the cache
+    fd = open("pcfile", O_RDONLY);
+    for(i = 0; i < 3*4096; i += 512){
+      if(read(fd, buf, 512) != 512 || buf[0] != 'a' + j + i/4096){
+        printf(1, "pcache test read wrong data\n");
+        exit();
+      }
+    }
+    close(fd);
+  }
+
+  // overwrite across the first page boundary
+  fd = open("pcfile", O_WRONLY);
+  if(read(fd, buf, 1) >= 0){
+    printf(1, "pcache test read write-only file\n");
+    exit();
+  }
+  memset(buf, 'x', 4096);
+  write(fd, buf, 4096 - 10);
+  write(fd, buf, 20);
+  close(fd);
+
+  fd = open("pcfile", O_RDONLY);
+  if(read(fd, buf, 4096 - 11) != 4096 - 11 || read(fd, buf, 22) != 22){
+    printf(1, "pcache test short read\n");
+    exit();
+  }
+  if(buf[0] != 'x' || buf[20] != 'x' || buf[21] != 'c'){
+    printf(1, "pcache test stale data after write\n");
+    exit();
+  }
+  close(fd);
+  unlink("pcfile");
+
+  printf(1, "pcache test ok\n");
+}
+
 void
 fourteen(void)
 {
@@ -1411,6 +1857,375 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// does fork() share memory copy-on-write correctly?
+// each side must see its own writes and not the other's,
+// including writes the kernel makes on its behalf.
+void
+cowtest(void)
+{
+  char *a;
+  int i, pid, fds[2];
+
+  printf(stdout, "cow test\n");
+  a = sbrk(8*4096);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "cow test sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < 8; i++)
+    a[i*4096] = i;
+  if(pipe(fds) != 0){
+    printf(stdout, "cow test pipe failed\n");
+    exit();
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < 8; i++){
+      if(a[i*4096] != i){
+        printf(stdout, "cow test child saw %d, not %d\n", a[i*4096], i);
+        exit();
+      }
+      a[i*4096] = 100 + i;
+    }
+    // the kernel writes into a shared page here
+    write(fds[1], "x", 1);
+    if(read(fds[0], a + 4096 + 1, 1) != 1 || a[4096+1] != 'x'){
+      printf(stdout, "cow test child read failed\n");
+      exit();
+    }
+    for(i = 0; i < 8; i++){
+      if(a[i*4096] != 100 + i){
+        printf(stdout, "cow test child lost its write\n");
+        exit();
+      }
+    }
+    exit();
+  }
+  wait();
+  close(fds[0]);
+  close(fds[1]);
+
+  for(i = 0; i < 8; i++){
+    if(a[i*4096] != i){
+      printf(stdout, "cow test parent saw child's write %d\n", a[i*4096]);
+      exit();
+    }
+  }
+  if(a[4096+1] == 'x'){
+    printf(stdout, "cow test parent saw child's read\n");
+    exit();
+  }
+  sbrk(-8*4096);
+  printf(stdout, "cow test OK\n");
+}
+
+// private and shared file mappings, across fork and
+// alongside read() and write() of the same file
+void
+mmaptest(void)
+{
+  int fd, fd2, i, pid, n, fds[2];
+  char *a;
+  char buf[512];
+
+  printf(stdout, "mmap test\n");
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "mmap test create failed\n");
+    exit();
+  }
+  // two pages and a bit
+  for(i = 0; i < 2*4096 + 100; i += n){
+    n = 2*4096 + 100 - i;
+    if(n > sizeof(buf))
+      n = sizeof(buf);
+    memset(buf, 'a' + i/4096, n);
+    if(write(fd, buf, n) != n){
+      printf(stdout, "mmap test write failed\n");
+      exit();
+    }
+  }
+
+  if(mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 100) != (void*)-1){
+    printf(stdout, "mmap test took unaligned offset\n");
+    exit();
+  }
+
+  // private: writes stay in this process
+  a = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf(stdout, "mmap test private mmap failed\n");
+    exit();
+  }
+  if(a[0] != 'a' || a[4096] != 'b' || a[2*4096+99] != 'c' || a[2*4096+100] != 0){
+    printf(stdout, "mmap test private mapping has wrong contents\n");
+    exit();
+  }
+  a[0] = 'x';
+  if(munmap(a, 3*4096) < 0){
+    printf(stdout, "mmap test munmap failed\n");
+    exit();
+  }
+
+  // shared: writes reach the file, from parent and child
+  a = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf(stdout, "mmap test shared mmap failed\n");
+    exit();
+  }
+  if(a[0] != 'a'){
+    printf(stdout, "mmap test private write reached the file\n");
+    exit();
+  }
+  a[1] = 'y';
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "mmap test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    a[4096+1] = 'z';
+    exit();
+  }
+  wait();
+  if(a[4096+1] != 'z'){
+    printf(stdout, "mmap test parent did not see child's write\n");
+    exit();
+  }
+  // write() shows up in the mapping
+  fd2 = open("mmapfile", O_WRONLY);
+  if(fd2 < 0 || write(fd2, "ayw", 3) != 3 || a[2] != 'w'){
+    printf(stdout, "mmap test mapping did not see write()\n");
+    exit();
+  }
+  close(fd2);
+  if(munmap(a, 2*4096) < 0){
+    printf(stdout, "mmap test munmap failed\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 3) != 3 || buf[0] != 'a' || buf[1] != 'y' || buf[2] != 'w'){
+    printf(stdout, "mmap test file lost shared write\n");
+    exit();
+  }
+  for(i = 3; i < 4096+2; i += n){
+    n = 4096+2 - i;
+    if(n > sizeof(buf))
+      n = sizeof(buf);
+    if(read(fd, buf, n) != n){
+      printf(stdout, "mmap test read failed\n");
+      exit();
+    }
+  }
+  if(buf[n-1] != 'z'){
+    printf(stdout, "mmap test file lost child's shared write\n");
+    exit();
+  }
+
+  // a read-only mapping may not be written through
+  pid = fork();
+  if(pid == 0){
+    a = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+    a[0] = 'q';
+    printf(stdout, "mmap test wrote read-only mapping\n");
+    exit();
+  }
+  wait();
+
+  // but write() may take its data from one, and read() not
+  a = mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 0);
+  if(a == (char*)-1 || pipe(fds) < 0){
+    printf(stdout, "mmap test read-only mmap failed\n");
+    exit();
+  }
+  if(write(fds[1], a, 3) != 3 || read(fds[0], buf, 3) != 3 || buf[2] != 'w'){
+    printf(stdout, "mmap test could not write() from read-only mapping\n");
+    exit();
+  }
+  if(read(fd, a, 1) != -1){
+    printf(stdout, "mmap test read() into read-only mapping\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+  munmap(a, 4096);
+  close(fd);
+  unlink("mmapfile");
+  printf(stdout, "mmap test OK\n");
+}
+
+// a shared memory segment is seen by both parent and child,
+// and survives the parent detaching while the child uses it
+void
+shmtest(void)
+{
+  int id, pid, i, fds[2];
+  char *a, *b;
+
+  printf(stdout, "shm test\n");
+  id = shmget(1234, 2*4096);
+  if(id < 0){
+    printf(stdout, "shm test shmget failed\n");
+    exit();
+  }
+  if(shmget(1234, 3*4096) >= 0){
+    printf(stdout, "shm test shmget grew a segment\n");
+    exit();
+  }
+  a = shmat(id);
+  if(a == (char*)-1){
+    printf(stdout, "shm test shmat failed\n");
+    exit();
+  }
+  b = shmat(id);
+  if(b == (char*)-1 || b == a){
+    printf(stdout, "shm test second shmat failed\n");
+    exit();
+  }
+  for(i = 0; i < 2*4096; i++){
+    if(a[i] != 0){
+      printf(stdout, "shm test segment not zeroed\n");
+      exit();
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "shm test fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // wait for the parent to detach b
+    while(a[0] != 1)
+      sleep(1);
+    for(i = 0; i < 2*4096; i++)
+      b[i] = i;
+    a[0] = 2;
+    exit();
+  }
+  if(shmdt(b) < 0 || shmdt(b) == 0){
+    printf(stdout, "shm test shmdt failed\n");
+    exit();
+  }
+  a[0] = 1;
+  wait();
+  if(a[0] != 2){
+    printf(stdout, "shm test parent did not see child's write\n");
+    exit();
+  }
+  for(i = 1; i < 2*4096; i++){
+    if(a[i] != (char)i){
+      printf(stdout, "shm test bad byte %d\n", i);
+      exit();
+    }
+  }
+  // system calls take buffers in the segment directly
+  if(pipe(fds) < 0 || write(fds[1], a + 1, 256) != 256 ||
+     read(fds[0], a + 4096, 256) != 256){
+    printf(stdout, "shm test I/O from segment failed\n");
+    exit();
+  }
+  for(i = 0; i < 256; i++){
+    if(a[4096 + i] != (char)(i + 1)){
+      printf(stdout, "shm test read into segment bad byte %d\n", i);
+      exit();
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(shmdt(a) < 0){
+    printf(stdout, "shm test shmdt failed\n");
+    exit();
+  }
+  // detaching everything keeps the segment until shmrm
+  if(shmget(1234, 2*4096) != id || (a = shmat(id)) == (char*)-1 ||
+     a[4096] != 1){
+    printf(stdout, "shm test segment destroyed by shmdt\n");
+    exit();
+  }
+  if(shmrm(id) < 0 || shmrm(id) == 0 || shmat(id) != (char*)-1){
+    printf(stdout, "shm test shmrm failed\n");
+    exit();
+  }
+  // a removed segment stays usable while attached
+  a[4096] = 5;
+  if(a[4096] != 5 || shmdt(a) < 0){
+    printf(stdout, "shm test removed segment unusable\n");
+    exit();
+  }
+  // the old key now makes a new, bigger segment,
+  // and the old id does not reach it
+  i = shmget(1234, 3*4096);
+  if(i < 0 || i == id || shmat(id) != (char*)-1 ||
+     (a = shmat(i)) == (char*)-1 || a[4096] != 0){
+    printf(stdout, "shm test segment not destroyed\n");
+    exit();
+  }
+  shmdt(a);
+  // with nothing attached, shmrm destroys it at once
+  if(shmrm(i) < 0){
+    printf(stdout, "shm test shmrm of new segment failed\n");
+    exit();
+  }
+  printf(stdout, "shm test OK\n");
+}
+
+// how long does fork() take for a process with a big heap?
+// with copy-on-write it should not grow with the heap size,
+// as copying 64MB twenty times would.
+void
+forkbench(void)
+{
+  static int mb[] = { 1, 16, 64 };
+  char *a, *p;
+  int i, j, n, pid, t, t1;
+
+  printf(stdout, "fork bench\n");
+  t1 = 0;
+  for(j = 0; j < sizeof(mb)/sizeof(mb[0]); j++){
+    n = mb[j]*1024*1024;
+    a = sbrk(n);
+    if(a == (char*)0xffffffff){
+      printf(stdout, "fork bench sbrk failed\n");
+      exit();
+    }
+    for(p = a; p < a + n; p += 4096)
+      *p = 1;
+
+    t = uptime();
+    for(i = 0; i < 20; i++){
+      pid = fork();
+      if(pid < 0){
+        printf(stdout, "fork bench fork failed\n");
+        exit();
+      }
+      if(pid == 0)
+        exit();
+      wait();
+    }
+    t = uptime() - t;
+
+    sbrk(-n);
+    printf(stdout, "fork bench: 20 forks of a %d KB process took %d ticks\n",
+           (uint)sbrk(0) / 1024 + n / 1024, t);
+    if(j == 0)
+      t1 = t;
+    else if(t > 2*t1 + 10){
+      printf(stdout, "fork bench: fork time grows with heap size\n");
+      exit();
+    }
+  }
+  printf(stdout, "fork bench OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1546,6 +2361,190 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// touch more pages than fit in memory, so some must go out
+// to the swap area, then check that every one reads back
+void
+swaptest(void)
+{
+  char *a;
+  uint lo, hi, mid, n, i;
+
+  printf(stdout, "swap test\n");
+  if(fork() != 0){
+    wait();
+    return;
+  }
+
+  // sbrk() grants at most free memory plus free swap;
+  // ask for 2MB less than that, and touch it all.
+  a = sbrk(0);
+  lo = 0;
+  hi = (0x40000000 - (uint)a) / 4096;
+  while(lo + 1 < hi){
+    mid = (lo + hi) / 2;
+    if(sbrk(mid*4096) == (char*)-1)
+      hi = mid;
+    else {
+      sbrk(-mid*4096);
+      lo = mid;
+    }
+  }
+  if(lo < 1024){
+    printf(stdout, "swap test: only %d pages\n", lo);
+    exit();
+  }
+  n = lo - 512;
+  if(sbrk(n*4096) != a){
+    printf(stdout, "swap sbrk failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i++)
+    *(uint*)(a + i*4096) = i;
+  for(i = 0; i < n; i++){
+    if(*(uint*)(a + i*4096) != i){
+      printf(stdout, "swap: page %d read back wrong\n", i);
+      exit();
+    }
+  }
+  printf(stdout, "swap test ok\n");
+  exit();
+}
+
+// sbrk() only reserves memory; pages appear, zeroed, on
+// first touch. a sparse heap must survive fork and shrinking.
+void
+lazysbrktest(void)
+{
+  char *a, *p;
+  int pid;
+
+  printf(stdout, "lazy sbrk test\n");
+  a = sbrk(64*1024*1024);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "lazy sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + 64*1024*1024; p += 1024*1024){
+    if(*p != 0){
+      printf(stdout, "lazy sbrk page not zero\n");
+      exit();
+    }
+    *p = 1;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "lazy sbrk fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(p = a; p < a + 64*1024*1024; p += 1024*1024){
+      if(*p != 1 || p[4096] != 0){
+        printf(stdout, "lazy sbrk child saw wrong data\n");
+        exit();
+      }
+    }
+    exit();
+  }
+  wait();
+  if(sbrk(-64*1024*1024) != a + 64*1024*1024 || sbrk(0) != a){
+    printf(stdout, "lazy sbrk could not shrink\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test OK\n");
+}
+
+// grow the heap by whole 4MB regions, which the kernel maps
+// with superpages, fill them without page faults, read()
+// into one, shrink the heap part way into one, which splits
+// it up again, and fork.
+void
+superpagetest(void)
+{
+  char *a, *p, *top;
+  int pid, n, fds[2];
+  struct vmstat st0, st;
+
+  printf(stdout, "superpage test\n");
+  a = sbrk(0);
+  top = (char*)(((uint)a + 3*4*1024*1024) & ~(4*1024*1024 - 1));
+  n = (top - (char*)(((uint)a + 4*1024*1024 - 1) & ~(4*1024*1024 - 1))) /
+      (4*1024*1024);
+  vmstat(&st0);
+  if(sbrk(top - a) != a){
+    printf(stdout, "superpage sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < top; p += 4096)
+    *(int*)p = (uint)p;
+  for(p = a; p < top; p += 4096){
+    if(*(int*)p != (uint)p || p[4095] != 0){
+      printf(stdout, "superpage wrong data\n");
+      exit();
+    }
+  }
+  if(vmstat(&st) < 0 || st.npromote != st0.npromote + n ||
+     st.nsuper != st0.nsuper + n ||
+     st.nzfault - st0.nzfault > (top - a) / 4096 - n*1024){
+    printf(stdout, "superpage not promoted: %d of %d\n",
+           st.npromote - st0.npromote, n);
+    exit();
+  }
+
+  if(pipe(fds) != 0){
+    printf(stdout, "superpage pipe failed\n");
+    exit();
+  }
+  write(fds[1], "xyz", 3);
+  if(read(fds[0], top - 4*1024*1024 + 100, 3) != 3 ||
+     top[-4*1024*1024 + 100] != 'x' || top[-4*1024*1024 + 102] != 'z'){
+    printf(stdout, "superpage read failed\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-3*1024*1024) != top){
+    printf(stdout, "superpage shrink failed\n");
+    exit();
+  }
+  if(vmstat(&st) < 0 || st.nsuper != st0.nsuper + n - 1){
+    printf(stdout, "superpage not demoted by shrink\n");
+    exit();
+  }
+  top -= 3*1024*1024;
+  for(p = a; p < top; p += 4096){
+    if(*(int*)p != (uint)p){
+      printf(stdout, "superpage wrong data after shrink\n");
+      exit();
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "superpage fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(p = a; p < top; p += 4096){
+      if(*(int*)p != (uint)p){
+        printf(stdout, "superpage child saw wrong data\n");
+        exit();
+      }
+      *(int*)p = 0;
+    }
+    exit();
+  }
+  wait();
+  for(p = a; p < top; p += 4096){
+    if(*(int*)p != (uint)p){
+      printf(stdout, "superpage child's write reached parent\n");
+      exit();
+    }
+  }
+  sbrk(a - sbrk(0));
+  printf(stdout, "superpage test ok\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1754,6 +2753,9 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazysbrktest();
+  superpagetest();
+  swaptest();
   validatetest();
 
   opentest();
@@ -1773,16 +2775,28 @@ main(int argc, char *argv[])
   rmdot();
   fourteen();
   bigfile();
+  pcachetest();
   subdir();
   linktest();
   unlinkread();
   dirfile();
   iref();
   forktest();
+  cowtest();
+  forkbench();
+  shmtest();
+  mmaptest();
   bigdir(); // slow
 
   uio();
 
+  clonetest();
+  futextest();
+  prioritytest();
+  stridetest();
+  affinitytest();
+  realtimetest();
+  spawntest();
   exectest();
 
   exit();
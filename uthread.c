@@ -0,0 +1,111 @@
+// User-level threads on top of clone() and join(), with
+// locks and condition variables that sleep in futexwait().
+//
+// Each thread runs on a one-page stack from malloc(), which
+// thread_join() frees once the thread has exited. malloc()
+// itself is not thread safe: call thread_create() and
+// thread_join() from one thread only, or under a lock.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+#include "param.h"
+
+#define PGSIZE	4096
+
+// Start fcn(arg1, arg2) in a new thread that shares this
+// process's memory. Returns the thread's pid, or -1.
+int
+thread_create(void (*fcn)(void*, void*), void *arg1, void *arg2)
+{
+	void *stack;
+	int pid;
+
+	if ((stack = malloc(PGSIZE)) == 0)
+		return -1;
+	if ((pid = clone(fcn, arg1, arg2, stack)) < 0)
+		free(stack);
+	return pid;
+}
+
+
+// Wait for a thread to exit, free its stack, and return
+// its pid. Returns -1 if there are no threads.
+int
+thread_join(void)
+{
+	void *stack;
+	int pid;
+
+	if ((pid = join(&stack)) >= 0)
+		free(stack);
+	return pid;
+}
+
+
+// Locks hold 0 when free, 1 when held, and 2 when held
+// with threads perhaps sleeping in futexwait() for them,
+// so that an uncontended lock never enters the kernel.
+void
+lock_init(struct lock_t *lk)
+{
+	lk->locked = 0;
+}
+
+
+void
+lock_acquire(struct lock_t *lk)
+{
+	if (xchg(&lk->locked, 1) == 0)
+		return;
+	while (xchg(&lk->locked, 2) != 0)
+		futexwait((void*)&lk->locked, 2);
+}
+
+
+void
+lock_release(struct lock_t *lk)
+{
+	if (xchg(&lk->locked, 0) == 2)
+		futexwake((void*)&lk->locked, 1);
+}
+
+
+// Condition variables count signals in seq; a waiter
+// sleeps only if no signal came since it dropped the lock.
+// Callers of cond_signal() and cond_broadcast() must
+// hold the lock that the waiters use.
+void
+cond_init(struct cond_t *cv)
+{
+	cv->seq = 0;
+}
+
+
+void
+cond_wait(struct cond_t *cv, struct lock_t *lk)
+{
+	uint seq;
+
+	seq = cv->seq;
+	lock_release(lk);
+	futexwait((void*)&cv->seq, seq);
+	lock_acquire(lk);
+}
+
+
+void
+cond_signal(struct cond_t *cv)
+{
+	cv->seq++;
+	futexwake((void*)&cv->seq, 1);
+}
+
+
+void
+cond_broadcast(struct cond_t *cv)
+{
+	cv->seq++;
+	futexwake((void*)&cv->seq, NPROC);
+}
@@ -4,8 +4,14 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "traps.h"
 #include "proc.h"
 #include "elf.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "pcache.h"
 
 extern char data[];		// defined by kernel.ld
 pde_t *kpgdir;			// for use in scheduler()
@@ -55,7 +61,10 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 	// to find the page directory entry.
 	pde = &pgdir[PDX(va)];
 
-	// Is the page directory entry present?
+	// Is the page directory entry present? A 4Mbyte
+	// page (PTE_PS) has no page table, and so no PTE.
+	if (*pde & PTE_PS)
+		return 0;
 	if (*pde & PTE_P)
 	{
 		pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
@@ -64,11 +73,11 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 	// has not yet been allocated.
 	else
 	{
-		// If the alloc argument is set, allocate it.
-		if (!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+		// If the alloc argument is set, allocate it,
+		// zeroed to make sure all of those PTE_P bits
+		// are zero.
+		if (!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
 			return 0;
-		// Make sure all of those PTE_P bits are zero
-		memset(pgtab, 0, PGSIZE);
 		// Put the physical address in the page directory.
 		// The permissions here are overly generous, but
 		// they can be further restricted by the permissions
@@ -121,6 +130,34 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 }
 
 
+// Split the superpage that maps va in pgdir into ordinary
+// pages: a page table whose PTEs map the same physical
+// pages with the same permissions, each of which now has
+// its own reference count (see ksplit). The translations
+// do not change, so no TLB flush is needed until a PTE
+// does. Returns -1 if there is no memory for the table.
+static int
+demote(pde_t *pgdir, uint va)
+{
+	pde_t *pde;
+	pte_t *pgtab;
+	uint pa, flags, i;
+
+	pde = &pgdir[PDX(va)];
+	if ((*pde & (PTE_P|PTE_PS|PTE_U)) != (PTE_P|PTE_PS|PTE_U))
+		panic("demote");
+	if ((pgtab = (pte_t*)kalloc()) == 0)
+		return -1;
+	pa = PTE_ADDR(*pde);
+	flags = PTE_FLAGS(*pde) & ~PTE_PS;
+	for (i = 0; i < NPTENTRIES; i++)
+		pgtab[i] = (pa + i*PGSIZE) | flags;
+	ksplit(P2V(pa), MAXORDER);
+	*pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+	return 0;
+}
+
+
 // There is one page table per process, plus one that is
 // used when a CPU is not running any processes (kpgdir).
 // The kernel uses the current process's page table during
@@ -138,7 +175,7 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //	KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data) for the
 //							kenel's instructions and r/o data
 //
-//	data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP for
+//	data..KERNBASE+phystop: mapped to V2P(data)..phystop for
 //							r/w data + free physical memory
 //
 //	0xfe000000..0: mapped direct (devices suchh as ioapic)
@@ -146,8 +183,18 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //
 // The kernel allocates physical memory for its heap and for
 // user memory between V2P(end) and the end of physical
-// memory (PHYSTOP)
-//	( directly addressable from end..P2V(PHYSTOP) )
+// memory (phystop, found by e820init() at boot)
+//	( directly addressable from end..P2V(phystop) )
+// Holes in physical memory below phystop are mapped too,
+// but never handed out by kalloc().
+//
+// The kernel's mappings are built once, in kpgdir, and
+// every other page table shares its page directory entries
+// above KERNBASE. They are global (PTE_G), so switching
+// page tables does not flush them from the TLB, and where
+// they can be they are 4Mbyte pages (PTE_PS), so the direct
+// map of physical memory needs few TLB entries and almost
+// no page tables.
 
 // This table defines the kernel's mappings, which are present
 // in every process's page table.
@@ -159,10 +206,48 @@ static struct kmap {
 } kmap[] = {
 	{ (void*)KERNBASE,	0,				EXTMEM,		PTE_W},	// I/O space
 	{ (void*)KERNLINK,	V2P(KERNLINK),	V2P(data),	0},		// kern text+rodata
-	{ (void*)data,		V2P(data),		PHYSTOP,	PTE_W}, // kern data+memory
+	{ (void*)data,		V2P(data),		0,			PTE_W}, // kern data+memory
 	{ (void*)DEVSPACE,	DEVSPACE,		0,			PTE_W}, // more devices
 };
 
+#define KMAP_MEM	2		// kmap entry whose end is phystop
+
+
+// Install the global mappings described by k in pgdir,
+// using a 4Mbyte page wherever both the virtual and the
+// physical address are 4Mbyte aligned, and ordinary pages
+// for the rest.
+static int
+kmappages(pde_t *pgdir, struct kmap *k)
+{
+	uint va, pa, size, n;
+
+	va = (uint)k->virt;
+	pa = k->phys_start;
+	size = k->phys_end - k->phys_start;		// may wrap to the top, for DEVSPACE
+	while (size > 0)
+	{
+		if (va % PDSIZE == 0 && pa % PDSIZE == 0 && size >= PDSIZE)
+		{
+			pgdir[PDX(va)] = pa | k->perm | PTE_P | PTE_PS | PTE_G;
+			n = PDSIZE;
+		}
+		else
+		{
+			// Ordinary pages up to the next 4Mbyte boundary
+			n = PDSIZE - va % PDSIZE;
+			if (n > size)
+				n = size;
+			if (mappages(pgdir, (void*)va, n, pa, k->perm | PTE_G) < 0)
+				return -1;
+		}
+		va += n;
+		pa += n;
+		size -= n;
+	}
+	return 0;
+}
+
 
 // Set up the kernel part of a page table.
 // Does NOT install any mappings for the
@@ -175,21 +260,29 @@ setupkvm(void)
 
 	// Allocate a page of memory to
 	// hold the page directory.
-	if ((pgdir = (pde_t*)kalloc()) == 0)
+	if ((pgdir = (pde_t*)kalloc_zeroed()) == 0)
 		return 0;
-	memset(pgdir, 0, PGSIZE);
-	if (P2V(PHYSTOP) > (void*)DEVSPACE)
-		panic("PHYSTOP too high");
 
-	// Call mappages() to install the translations
+	// Once kpgdir exists, share its kernel page tables
+	// and 4Mbyte pages by copying its directory entries.
+	if (kpgdir)
+	{
+		memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+				(NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
+		return pgdir;
+	}
+
+	if (P2V(phystop) > (void*)DEVSPACE)
+		panic("phystop too high");
+
+	// Call kmappages() to install the translations
 	// that the kernel needs, which are described
 	// in the kmap array. These include the kernel's
 	// instructions and data, physical memory up to
-	// PHYSTOP, and memory ranges which are actually
+	// phystop, and memory ranges which are actually
 	// I/O devices.
 	for (k = kmap; k < &kmap[NELEM(kmap)]; k++)
-		if (mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-						(uint)k->phys_start, k->perm) < 0)
+		if (kmappages(pgdir, k) < 0)
 			return 0;
 
 	return pgdir;
@@ -203,6 +296,9 @@ setupkvm(void)
 void
 kvmalloc(void)
 {
+	// The top of the direct map is only known at run time
+	kmap[KMAP_MEM].phys_end = phystop;
+
 	// Most of the work happens here
 	kpgdir = setupkvm();
 
@@ -233,10 +329,53 @@ switchuvm(struct proc *p)
 	// from user space
 	cpu->ts.iomb = (ushort) 0xFFFF;
 	ltr(SEG_TSS << 3);
-	if (p->pgdir == 0)
+	// An exiting process has given up its address space
+	// (see exit) and runs on the kernel's page table.
+	if (p->as == 0)
+		lcr3(V2P(kpgdir));
+	else if (p->as->pgdir == 0)
 		panic("switchuvm: no pgdir");
-	lcr3(V2P(p->pgdir));		// switch to process's address space
+	else
+		lcr3(V2P(p->as->pgdir));		// switch to process's address space
+	popcli();
+}
+
+
+// Make the other CPUs that are running threads of as drop
+// their cached translations, after a change to its page
+// table that took some access away, and wait until they
+// have. A CPU waiting here must take the flush interrupts
+// that other CPUs send it, so the caller must not hold a
+// spinlock.
+void
+tlbshootdown(struct aspace *as)
+{
+	uint seen[NCPU];
+	int i, sent[NCPU];
+
+	if (as->ref < 2)
+		return;
+	if (cpu->ncli > 0)
+		panic("tlbshootdown");
+
+	// A CPU that switches to as after this looks at the
+	// page table afresh, so only those running it now
+	// need to be told.
+	pushcli();
+	for (i = 0; i < ncpu; i++)
+	{
+		sent[i] = &cpus[i] != cpu && cpus[i].proc && cpus[i].proc->as == as;
+		if (sent[i])
+		{
+			seen[i] = cpus[i].ntlbflush;
+			lapicipi(cpus[i].apicid, T_TLBFLUSH);
+		}
+	}
 	popcli();
+
+	for (i = 0; i < ncpu; i++)
+		while (sent[i] && cpus[i].ntlbflush == seen[i])
+			;
 }
 
 
@@ -249,37 +388,26 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
 	if (sz >= PGSIZE)
 		panic("inituvm: more than a page");
-	mem = kalloc();
-	memset(mem, 0, PGSIZE);
+	mem = kalloc_zeroed();
 	mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
 	memmove(mem, init, sz);
 }
 
 
-// Load a program segment into pgdir. addr must be
-// page-aligned and the pages from addr to addr+sz
-// must already be mapped.
-int
-loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+// Allocate a zeroed page for user memory. If memory has
+// run out, swap other user pages out to make room, unless
+// the caller holds a spinlock, since swapping sleeps.
+static char*
+ualloc(void)
 {
-	uint i, pa, n;
-	pte_t *pte;
+	char *mem;
 
-	if ((uint) addr % PGSIZE != 0)
-		panic("loaduvm: addr must be page aligned");
-	for (i = 0; i < sz; i += PGSIZE)
+	while ((mem = kalloc_zeroed()) == 0)
 	{
-		if ((pte = walkpgdir(pgdir, addr+i, 0)) == 0)
-			panic("loaduvm: address should exist");
-		pa = PTE_ADDR(*pte);
-		if (sz - i < PGSIZE)
-			n = sz - i;
-		else
-			n = PGSIZE;
-		if (readi(ip, P2V(pa), offset+i, n) != n)
-			return -1;
+		if (cpu->ncli > 0 || swapout() < 0)
+			return 0;
 	}
-	return 0;
+	return mem;
 }
 
 
@@ -292,7 +420,7 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 	char *mem;
 	uint a;
 
-	if (newsz >= KERNBASE)
+	if (newsz >= MMAPBASE)
 		return 0;
 	if (newsz < oldsz)
 		return oldsz;
@@ -300,7 +428,7 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 	a = PGROUNDUP(oldsz);
 	for( ; a < newsz; a += PGSIZE)
 	{
-		mem = kalloc();
+		mem = ualloc();
 		if (mem == 0)
 		{
 			cprintf("allocuvm out of memory\n");
@@ -308,7 +436,6 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 			return 0;
 		}
 
-		memset(mem, 0, PGSIZE);
 		if (mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0)
 		{
 			cprintf("allocuvm out of memory (2)\n");
@@ -321,15 +448,68 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 }
 
 
+// Map each whole, aligned 4Mbyte region of heap between
+// oldsz and newsz, which growproc() is adding, with a
+// superpage: one 4Mbyte page (PTE_PS) from a contiguous
+// block, which takes a single TLB entry instead of 1024.
+// The block is zeroed here, rather than page by page in
+// pagefault(), so that making a superpage never copies
+// pages or holds two copies of a region. A region whose
+// page table is still there, or for which there is no
+// free block, is left to be filled in page by page, as is
+// the rest of a large sbrk() once free memory runs low,
+// so that it does not take pages other processes need.
+// Returns the number of superpages made.
+int
+allocsuper(pde_t *pgdir, uint oldsz, uint newsz)
+{
+	char *mem;
+	uint a;
+	int n;
+
+	n = 0;
+	for (a = PDROUNDUP(oldsz); a + PDSIZE <= newsz; a += PDSIZE)
+	{
+		if (kfreepages() < 4*NPTENTRIES)
+			break;
+		if (pgdir[PDX(a)] != 0 || (mem = kalloc_pages(MAXORDER)) == 0)
+			continue;
+		memset(mem, 0, PDSIZE);
+		pgdir[PDX(a)] = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+		n++;
+	}
+	return n;
+}
+
+
+// Count the superpages mapping [0, sz) in pgdir.
+int
+nsuper(pde_t *pgdir, uint sz)
+{
+	uint a;
+	int n;
+
+	n = 0;
+	for (a = 0; a < sz; a += PDSIZE)
+		if ((pgdir[PDX(a)] & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS))
+			n++;
+	return n;
+}
+
+
 // Deallocate user pages to bring the process size from
 // oldsz to newsz, neither of which need to be page-aligned.
 // newsz does not need to be less than oldsz, and oldsz can
 // be larger than the actual process size.
-// Returns the new process size.
+// A superpage that is freed whole goes back as one block;
+// one that is only partly freed is split first.
+// Returns the new process size, or 0 if a superpage could
+// not be split, in which case nothing has been freed.
 int
 deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
 	pte_t *pte;
+	pde_t *pde;
 	uint a, pa;
 
 	if (newsz >= oldsz)
@@ -338,9 +518,25 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 	a = PGROUNDUP(newsz);
 	for ( ; a < oldsz; a+= PGSIZE)
 	{
+		// Only the first superpage can be partly freed,
+		// since one never reaches past the process size.
+		pde = &pgdir[PDX(a)];
+		if (*pde & PTE_PS)
+		{
+			if (a % PDSIZE == 0 && a + PDSIZE <= oldsz)
+			{
+				kfree_pages(P2V(PTE_ADDR(*pde)), MAXORDER);
+				*pde = 0;
+				a += PDSIZE - PGSIZE;
+				continue;
+			}
+			if (demote(pgdir, a) < 0)
+				return 0;
+		}
 		pte = walkpgdir(pgdir, (char*)a, 0);
+		// No page table: skip to the next one
 		if (!pte)
-			a += (NPTENTRIES - 1) * PGSIZE;
+			a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
 		else if ((*pte & PTE_P) != 0)
 		{
 			pa = PTE_ADDR(*pte);
@@ -350,6 +546,11 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 			kfree(v);
 			*pte = 0;
 		}
+		else if ((*pte & PTE_SWAP) != 0)
+		{
+			swapfree(PTE_ADDR(*pte) >> PTXSHIFT);
+			*pte = 0;
+		}
 	}
 	return newsz;
 }
@@ -365,7 +566,8 @@ freevm(pde_t *pgdir)
 	if (pgdir == 0)
 		panic("freevm: no pgdir");
 	deallocuvm(pgdir, KERNBASE, 0);
-	for (i = 0; i < NPDENTRIES; i++)
+	// The page tables above KERNBASE belong to kpgdir
+	for (i = 0; i < PDX(KERNBASE); i++)
 	{
 		if (pgdir[i] & PTE_P)
 		{
@@ -391,36 +593,674 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 
-// Given a parent process's page table,
-// create a copy of it for a child.
-pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+#define COPYSHARE	0		// copyrange(): share writable pages
+#define COPYCOW		1		// share them copy-on-write
+#define COPYEAGER	2		// copy them
+
+// Map the pages that pgdir maps in [start, end) into d
+// as well. Writable pages are treated according to how:
+// COPYSHARE maps the same page in both, COPYCOW makes it
+// read-only and PTE_COW in both, and COPYEAGER gives d
+// a copy now, leaving pgdir's PTEs alone. Swapped-out
+// pages are copied as they are.
+// Returns 0, or -1 if there is no memory.
+static int
+copyrange(pde_t *d, pde_t *pgdir, uint start, uint end, int how)
 {
-	pde_t *d;
-	pte_t *pte;
+	pte_t *pte, *dpte;
 	uint pa, i, flags;
 	char *mem;
 
-	if ((d = setupkvm()) == 0)
-		return 0;
-	for (i = 0; i < sz; i += PGSIZE)
+	for (i = start; i < end; i += PGSIZE)
 	{
+		// A superpage is shared page by page
+		if ((pgdir[PDX(i)] & PTE_PS) && demote(pgdir, i) < 0)
+			return -1;
 		if ((pte = walkpgdir(pgdir, (void*) i, 0)) == 0)
-			panic("copyuvm: pte should exist");
+		{
+			i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+			continue;
+		}
+		if (*pte & PTE_SWAP)
+		{
+			// Share the slot; each reads in its own copy.
+			if ((dpte = walkpgdir(d, (void*) i, 1)) == 0)
+				return -1;
+			*dpte = *pte;
+			swapdup(PTE_ADDR(*pte) >> PTXSHIFT);
+			continue;
+		}
 		if (!(*pte & PTE_P))
-			panic("copyuvm: page not present");
+			continue;
 		pa = PTE_ADDR(*pte);
 		flags = PTE_FLAGS(*pte);
-		if ((mem = kalloc()) == 0)
-			goto bad;
-		memmove(mem, (char*)P2V(pa), PGSIZE);
-		if (mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
-			goto bad;
+		if (how == COPYEAGER && (*pte & PTE_W))
+		{
+			if ((mem = ualloc()) == 0)
+				return -1;
+			memmove(mem, P2V(pa), PGSIZE);
+			if (mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0)
+			{
+				kfree(mem);
+				return -1;
+			}
+			continue;
+		}
+		if (how == COPYCOW && (*pte & PTE_W))
+		{
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			flags = PTE_FLAGS(*pte);
+		}
+		if (mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+			return -1;
+		kref(P2V(pa));
+	}
+	return 0;
+}
+
+
+// Given a parent process's page table,
+// create a copy of it for a child.
+// The pages themselves are not copied: parent and child
+// share each one, read-only and marked PTE_COW, until
+// one of them writes to it (see cowfault). The caller
+// must flush the parent's TLB, since its PTEs change.
+// Pages the parent has not touched yet stay unmapped
+// in the child too.
+// If eager is set, writable pages are copied now
+// instead, since another thread of the parent may be
+// writing to them from the kernel (see argbuf).
+pde_t*
+copyuvm(pde_t *pgdir, uint sz, int eager)
+{
+	pde_t *d;
+
+	if ((d = setupkvm()) == 0)
+		return 0;
+	if (copyrange(d, pgdir, 0, sz, eager ? COPYEAGER : COPYCOW) < 0)
+	{
+		freevm(d);
+		return 0;
 	}
 	return d;
+}
+
+
+// Copy the pages of mmap() region v from pgdir to d, a
+// child's page table made by copyuvm(). Pages of a shared
+// region stay shared; private ones become copy-on-write,
+// or are copied now if eager is set.
+int
+copyvma(pde_t *d, pde_t *pgdir, struct vma *v, int eager)
+{
+	if (v->flags & VMA_SHARED)
+		return copyrange(d, pgdir, v->start, v->end, COPYSHARE);
+	return copyrange(d, pgdir, v->start, v->end, eager ? COPYEAGER : COPYCOW);
+}
+
+
+// Map the n pages in pages[] at va in pgdir, writable
+// and shared: each mapping holds its own reference, so
+// the pages live until every page table mapping them is
+// freed. Returns 0, or -1 with nothing mapped if there
+// is no memory for a page table.
+int
+mapshared(pde_t *pgdir, uint va, char **pages, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (mappages(pgdir, (char*)va + i*PGSIZE, PGSIZE, V2P(pages[i]), PTE_W|PTE_U) < 0)
+		{
+			deallocuvm(pgdir, va + i*PGSIZE, va);
+			return -1;
+		}
+		kref(pages[i]);
+	}
+	return 0;
+}
+
+
+// Handle a write to the copy-on-write page at va in pgdir
+// by giving pgdir its own writable copy of the page, or, if
+// no one else shares the page any more, by simply making it
+// writable again.
+// Returns 0 on success, or -1 if va is not a copy-on-write
+// user page or there is no memory for the copy.
+int
+cowfault(pde_t *pgdir, uint va)
+{
+	pte_t *pte;
+	uint pa, flags;
+	char *mem;
+
+	if (va >= KERNBASE || (pte = walkpgdir(pgdir, (void*)va, 0)) == 0)
+		return -1;
+	if ((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+		return -1;
+
+	mem = 0;
+	for ( ; ; )
+	{
+		pa = PTE_ADDR(*pte);
+		flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+		if (krefcount(P2V(pa)) == 1)
+		{
+			*pte = pa | flags;
+			break;
+		}
+		if (mem)
+		{
+			memmove(mem, P2V(pa), PGSIZE);
+			*pte = V2P(mem) | flags;
+			kfree(P2V(pa));
+			mem = 0;
+			break;
+		}
+
+		// ualloc() may sleep in swapout(), during which the
+		// other sharers may go away and the page be swapped
+		// out and freed; look at the PTE again afterwards.
+		if ((mem = ualloc()) == 0)
+			return -1;
+		if ((*pte & (PTE_P|PTE_U|PTE_COW)) != (PTE_P|PTE_U|PTE_COW))
+		{
+			// No longer copy-on-write: let the access
+			// be retried, to fault in whatever it needs.
+			kfree(mem);
+			return 0;
+		}
+	}
+	if (mem)
+		kfree(mem);
+	invlpg((void*)PGROUNDDOWN(va));
+	return 0;
+}
+
+
+// Return the file-backed region of p containing va, or 0.
+static struct vma*
+findvma(struct proc *p, uint va)
+{
+	struct vma *v;
+
+	for (v = p->as->vma; v < &p->as->vma[NVMA]; v++)
+		if (v->ip && va >= v->start && va < v->end)
+			return v;
+	return 0;
+}
+
+
+// Read the page at va of region v into mem, which is
+// zeroed; the part past v->filesz stays zero.
+// Sleeps on the inode lock, so the caller must not
+// hold any spinlocks.
+static int
+vmaread(struct vma *v, char *mem, uint va)
+{
+	uint n, off;
+
+	off = va - v->start;
+	if (off >= v->filesz)
+		return 0;
+	n = v->filesz - off;
+	if (n > PGSIZE)
+		n = PGSIZE;
+	ilock(v->ip);
+	if (readi(v->ip, mem, v->off + off, n) != n)
+	{
+		iunlock(v->ip);
+		return -1;
+	}
+	iunlock(v->ip);
+	return 0;
+}
+
+
+// Return the page at va of region v from the file page
+// cache, reading it in if need be, with a reference for
+// the caller to map. Only pages that lie wholly within
+// v->filesz can be shared; for others, or if the cache
+// is full, returns 0 and the caller reads a private copy.
+// Sleeps, like vmaread().
+static char*
+vmashare(struct vma *v, uint va)
+{
+	struct cpage *cp;
+	char *mem;
+	uint off;
+
+	off = va - v->start;
+	if (v->filesz < PGSIZE || off > v->filesz - PGSIZE)
+		return 0;
+
+	ilock(v->ip);
+	if ((cp = pcread(v->ip, v->off + off)) == 0)
+	{
+		iunlock(v->ip);
+		return 0;
+	}
+	mem = cp->data;
+	kref(mem);
+	pcrelse(cp);
+	iunlock(v->ip);
+	return mem;
+}
+
+
+// Write the pages of shared region v in [start, end) that
+// have been written to (PTE_D) in pgdir back to the file,
+// through the log. Does not grow the file. Each page goes
+// in pieces small enough for one transaction, as in
+// filewrite(). The page is the file's page cache page,
+// so writei() leaves the cache as it is.
+static void
+vmasync(pde_t *pgdir, struct vma *v, uint start, uint end)
+{
+	pte_t *pte;
+	uint a, off, n, m, max;
+	char *mem;
+
+	if (!(v->flags & VMA_SHARED))
+		return;
+	max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+	for (a = start; a < end; a += PGSIZE)
+	{
+		pte = walkpgdir(pgdir, (void*)a, 0);
+		if (pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D))
+			continue;
+		mem = P2V(PTE_ADDR(*pte));
+		off = v->off + (a - v->start);
+		for (n = 0; n < PGSIZE; n += m)
+		{
+			m = PGSIZE - n < max ? PGSIZE - n : max;
+			begin_op();
+			ilock(v->ip);
+			if (off + n >= v->ip->size)
+				m = 0;
+			else if (m > v->ip->size - (off + n))
+				m = v->ip->size - (off + n);
+			if (m > 0)
+				writei(v->ip, mem + n, off + n, m);
+			iunlock(v->ip);
+			end_op();
+			if (m == 0)
+				break;
+		}
+		*pte &= ~PTE_D;
+	}
+}
+
+
+// Write back the shared regions in v[NVMA] of pgdir and
+// drop the file references the regions hold.
+// Starts its own transactions, so the caller must not be
+// inside one.
+void
+freevmas(pde_t *pgdir, struct vma *v)
+{
+	int i;
+
+	for (i = 0; i < NVMA; i++)
+	{
+		if (v[i].ip)
+		{
+			vmasync(pgdir, &v[i], v[i].start, v[i].end);
+			begin_op();
+			iput(v[i].ip);
+			end_op();
+			v[i].ip = 0;
+		}
+	}
+}
+
+
+// Map n bytes of the file ip, from offset off, into the
+// current process, for mmap(). flags are VMA_WRITE and
+// VMA_SHARED. The region goes at the lowest free address
+// between MMAPBASE and SHMBASE; its pages are faulted in
+// from the page cache. Returns its address, or -1.
+int
+vmamap(struct inode *ip, uint n, int flags, uint off)
+{
+	struct vma *v, *nv;
+	uint a;
+
+	n = PGROUNDUP(n);
+	if (n == 0 || n > SHMBASE - MMAPBASE)
+		return -1;
+	aslock(proc->as);
+	for (nv = proc->as->vma; nv < &proc->as->vma[NVMA]; nv++)
+		if (nv->ip == 0)
+			break;
+	if (nv == &proc->as->vma[NVMA])
+		goto bad;
+
+	// First fit: step past each region in the way.
+	a = MMAPBASE;
+	for (v = proc->as->vma; v < &proc->as->vma[NVMA]; v++)
+	{
+		if (v->ip && v->start < a + n && a < v->end)
+		{
+			a = PGROUNDUP(v->end);
+			if (a + n > SHMBASE)
+				goto bad;
+			v = proc->as->vma - 1;
+		}
+	}
+
+	nv->start = a;
+	nv->end = a + n;
+	nv->ip = idup(ip);
+	nv->off = off;
+	nv->filesz = n;
+	nv->flags = flags;
+	asunlock(proc->as);
+	return a;
 
 bad:
-	freevm(d);
+	asunlock(proc->as);
+	return -1;
+}
+
+
+// Unmap the n bytes at va from an mmap() region of the
+// current process, writing shared pages back first.
+// The range may cover the whole region or cut pages off
+// either end of it, but not split it in two.
+int
+vmaunmap(uint va, uint n)
+{
+	struct vma *v;
+	uint end;
+
+	end = PGROUNDUP(va + n);
+	if (va % PGSIZE != 0 || n == 0 || end < va)
+		return -1;
+	aslock(proc->as);
+	if ((v = findvma(proc, va)) == 0 || v->start < MMAPBASE || end > v->end ||
+			(va != v->start && end != v->end) || ubufbusy(va, end))
+	{
+		asunlock(proc->as);
+		return -1;
+	}
+
+	vmasync(proc->as->pgdir, v, va, end);
+	deallocuvm(proc->as->pgdir, end, va);
+	switchuvm(proc);
+	tlbshootdown(proc->as);
+
+	if (va == v->start && end == v->end)
+	{
+		begin_op();
+		iput(v->ip);
+		end_op();
+		v->ip = 0;
+	}
+	else if (va == v->start)
+	{
+		v->off += end - va;
+		v->filesz -= end - va;
+		v->start = end;
+	}
+	else
+	{
+		v->end = va;
+		v->filesz = va - v->start;
+	}
+	asunlock(proc->as);
+	return 0;
+}
+
+
+// Is [va, va+n) within one mmap() region of the current
+// process, and a writable one if write is set? (The kernel
+// writes through some system calls' pointer arguments.)
+int
+vmaok(uint va, uint n, int write)
+{
+	struct vma *v;
+
+	if ((v = findvma(proc, va)) == 0 || v->start < MMAPBASE)
+		return 0;
+	if (write && !(v->flags & VMA_WRITE))
+		return 0;
+	return va + n >= va && va + n <= v->end;
+}
+
+
+// Read the swapped-out page that pte, in the current
+// process' page table, refers to back into memory.
+// Sleeps. Nothing else changes pte meanwhile: swapout()
+// only takes present pages.
+static int
+swapin(pte_t *pte)
+{
+	char *mem;
+	uint slot;
+
+	if ((mem = ualloc()) == 0)
+	{
+		cprintf("swapin out of memory\n");
+		return -1;
+	}
+	slot = PTE_ADDR(*pte) >> PTXSHIFT;
+	swapread(slot, mem);
+	*pte = V2P(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_P;
+	swapfree(slot);
+	proc->nswapin++;
+	return 0;
+}
+
+
+// Look for a page to swap out among pgdir's pages in
+// [*va, sz), by the clock algorithm: a page that has been
+// used since the hand last passed (PTE_A) gets a second
+// chance and has PTE_A cleared. Only private user pages
+// are candidates, those no one else maps; shared pages
+// would have to be unmapped everywhere. A superpage gets
+// its second chance as a whole, and is split if it has
+// not been used since. Returns the PTE of the page chosen,
+// with *va set to its address, or 0 with *va = sz if there
+// is none.
+// The caller must flush the TLB if pgdir is in use.
+pte_t*
+clockscan(pde_t *pgdir, uint *va, uint sz)
+{
+	pte_t *pte;
+	pde_t *pde;
+	uint a;
+
+	for (a = PGROUNDDOWN(*va); a < sz; a += PGSIZE)
+	{
+		pde = &pgdir[PDX(a)];
+		if ((*pde & PTE_PS) && ((*pde & PTE_A) || demote(pgdir, a) < 0))
+		{
+			*pde &= ~PTE_A;
+			a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+			continue;
+		}
+		if ((pte = walkpgdir(pgdir, (void*)a, 0)) == 0)
+		{
+			a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+			continue;
+		}
+		if ((*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+			continue;
+		if (krefcount(P2V(PTE_ADDR(*pte))) != 1)
+			continue;
+		if (*pte & PTE_A)
+		{
+			*pte &= ~PTE_A;
+			continue;
+		}
+		*va = a;
+		return pte;
+	}
+	*va = sz;
+	return 0;
+}
+
+
+// Handle a page fault at va in the current process,
+// from user code or from the kernel touching user memory
+// on the process' behalf. Four kinds are expected:
+//	- a first touch of a page in a file-backed region
+//		(program text and data set up by exec, or a file
+//		mapped with mmap()): map the file's page from the
+//		page cache. Every process running the same program
+//		or mapping the same file gets the same page. In a
+//		private region it is copied on the first write; a
+//		page that is only partly file data is read into a
+//		private copy straight away.
+//	- a first touch of any other page below proc->as->sz,
+//		which growproc() reserved but did not allocate:
+//		map a zeroed page. (Whole 4Mbyte regions of heap
+//		may instead be superpages from the start; see
+//		allocsuper.)
+//	- a write to a copy-on-write page (see cowfault).
+//	- a touch of a page that swapout() wrote to swap:
+//		read it back in.
+// Reading a file or swap can sleep, so the kernel must not
+// touch such pages while holding a spinlock; argptr() and
+// argwptr() fault user buffers in up front for this reason.
+// Returns 0 if the faulting instruction can be retried,
+// or -1 if the access was invalid or memory ran out.
+static int
+fillpage(uint va)
+{
+	pte_t *pte;
+	char *mem;
+	struct vma *v;
+	int perm;
+
+	v = findvma(proc, va);
+	if (va >= proc->as->sz && v == 0)
+		return -1;
+
+	pte = walkpgdir(proc->as->pgdir, (void*)va, 0);
+	if (pte && (*pte & PTE_SWAP))
+	{
+		if (cpu->ncli > 0)
+			return -1;
+		return swapin(pte);
+	}
+	if (pte == 0 || (*pte & PTE_P) == 0)
+	{
+		va = PGROUNDDOWN(va);
+		if (v && cpu->ncli > 0)
+			return -1;
+		if (v && (mem = vmashare(v, va)) != 0)
+		{
+			if (v->flags & VMA_SHARED)
+				perm = (v->flags & VMA_WRITE) ? PTE_W : 0;
+			else
+				perm = (v->flags & VMA_WRITE) ? PTE_COW : 0;
+			if (mappages(proc->as->pgdir, (void*)va, PGSIZE, V2P(mem), PTE_U|perm) < 0)
+			{
+				cprintf("pagefault out of memory (2)\n");
+				kfree(mem);
+				return -1;
+			}
+			proc->nfilefault++;
+			return 0;
+		}
+		// All pages of a shared region must come
+		// from the page cache.
+		if (v && (v->flags & VMA_SHARED))
+			return -1;
+		if ((mem = ualloc()) == 0)
+		{
+			cprintf("pagefault out of memory\n");
+			return -1;
+		}
+		if (v && vmaread(v, mem, va) < 0)
+		{
+			kfree(mem);
+			return -1;
+		}
+		// Reading the file may have slept, during which
+		// nothing else can have mapped va: this process
+		// was not running.
+		perm = (v == 0 || (v->flags & VMA_WRITE)) ? PTE_W : 0;
+		if (mappages(proc->as->pgdir, (void*)va, PGSIZE, V2P(mem), PTE_U|perm) < 0)
+		{
+			cprintf("pagefault out of memory (2)\n");
+			kfree(mem);
+			return -1;
+		}
+		if (v)
+			proc->nfilefault++;
+		else
+			proc->nzfault++;
+		return 0;
+	}
+
+	// Another thread may have filled the page in since
+	// this CPU's TLB entry for it was loaded.
+	if ((*pte & (PTE_W|PTE_U)) == (PTE_W|PTE_U))
+		return 0;
+	if (cowfault(proc->as->pgdir, va) < 0)
+		return -1;
+	proc->ncowfault++;
+	return 0;
+}
+
+
+// Handle a page fault at va in the current process (see
+// fillpage). When threads share the address space, only
+// one fills in pages at a time, and the others' CPUs drop
+// their old translations afterwards; that cannot be done
+// while the kernel holds a spinlock. System call buffers
+// are filled in before any is taken, and stay so while
+// in use (see argbuf), so such a fault is a kernel bug.
+int
+pagefault(uint va)
+{
+	struct aspace *as;
+	int r;
+
+	as = proc->as;
+	if (as->ref == 1)
+		return fillpage(va);
+	if (cpu->ncli > 0)
+		return -1;
+	aslock(as);
+	r = fillpage(va);
+	if (r == 0)
+		tlbshootdown(as);
+	asunlock(as);
+	return r;
+}
+
+
+// Fault in any unmapped pages of the current process
+// in [va, va+n), so that the kernel can then use the
+// range while holding locks. If write is set, also copy
+// any copy-on-write pages, since running out of memory
+// for the copy inside, say, piperead() could not be
+// reported to the caller. Returns -1 if any page
+// cannot be filled or, for write, is read-only.
+int
+prefault(uint va, uint n, int write)
+{
+	pte_t *pte;
+	uint a;
+
+	for (a = PGROUNDDOWN(va); a < va + n; a += PGSIZE)
+	{
+		for ( ; ; )
+		{
+			if (proc->as->pgdir[PDX(a)] & PTE_PS)
+				break;
+			pte = walkpgdir(proc->as->pgdir, (void*)a, 0);
+			if (pte && (*pte & PTE_P) && (!write || (*pte & PTE_W)))
+				break;
+			if (pagefault(a) < 0)
+				return -1;
+		}
+	}
 	return 0;
 }
 
@@ -430,9 +1270,13 @@ char*
 uva2ka(pde_t *pgdir, char *uva)
 {
 	pte_t *pte;
+	pde_t pde;
 
+	pde = pgdir[PDX(uva)];
+	if ((pde & (PTE_P|PTE_PS|PTE_U)) == (PTE_P|PTE_PS|PTE_U))
+		return (char*)P2V(PTE_ADDR(pde) + PTX(uva)*PGSIZE);
 	pte = walkpgdir(pgdir, uva, 0);
-	if ((*pte & PTE_P) == 0)
+	if (pte == 0 || (*pte & PTE_P) == 0)
 		return 0;
 	if ((*pte & PTE_U) == 0)
 		return 0;
@@ -443,16 +1287,22 @@ uva2ka(pde_t *pgdir, char *uva)
 // Copy len bytes from p to user address va in page
 // table pgdir. Most useful when pgdir is not the current
 // page table. uva2ka ensures this only works for PTE_U pages.
+// Copy-on-write pages are copied first, since writing
+// through the kernel's mapping would bypass PTE_W.
 int
 copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
 	char *buf, *pa0;
 	uint n, va0;
+	pte_t *pte;
 
 	buf = (char*)p;
 	while (len > 0)
 	{
 		va0 = (uint)PGROUNDDOWN(va);
+		pte = walkpgdir(pgdir, (char*)va0, 0);
+		if (pte && (*pte & PTE_COW) && cowfault(pgdir, va0) < 0)
+			return -1;
 		pa0 = uva2ka(pgdir, (char*)va0);
 		if (pa0 == 0)
 			return -1;
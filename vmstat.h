@@ -0,0 +1,9 @@
+// Paging statistics of a process, returned by vmstat().
+struct vmstat {
+	uint nzfault;			// Demand-zero page faults
+	uint nfilefault;		// Page faults read from a file
+	uint ncowfault;			// Copy-on-write page faults
+	uint nswapin;			// Pages read back from swap
+	uint npromote;			// Heap regions made superpages
+	uint nsuper;			// Superpages mapped now
+};